@@ -0,0 +1,174 @@
+#include <cstring>
+
+#include "BlockCompressor.h"
+
+using namespace std;
+
+// LZ4 block format constants
+#define MIN_MATCH     (4)
+#define LAST_LITERALS (5)   // the last 5 bytes are always literals
+#define MF_LIMIT      (12)  // the last match starts at least 12 bytes from the end
+#define MAX_OFFSET    (65535)
+#define HASH_LOG      (12)
+
+static unsigned int read32(const unsigned char *p) {
+  unsigned int value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static int hashSequence(unsigned int sequence) {
+  return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Lengths of 15 or more spill into extra bytes of 255, ending with one < 255.
+static unsigned char *writeLength(unsigned char *out, int length) {
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = (unsigned char) length;
+  return out;
+}
+
+int BlockCompressor::compress(const char *source, int sourceSize, char *dest, int destCapacity) {
+  const unsigned char *src = (const unsigned char *) source;
+  unsigned char *out = (unsigned char *) dest;
+  unsigned char *outEnd = out + destCapacity;
+
+  int table[1 << HASH_LOG];
+  for (int i = 0; i < (1 << HASH_LOG); i++) {
+    table[i] = -1;
+  }
+
+  int anchor = 0;
+  int pos = 0;
+  int matchStartLimit = sourceSize - MF_LIMIT;
+  int matchEndLimit = sourceSize - LAST_LITERALS;
+
+  while (pos < matchStartLimit) {
+    unsigned int sequence = read32(src + pos);
+    int h = hashSequence(sequence);
+    int candidate = table[h];
+    table[h] = pos;
+
+    if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(src + candidate) != sequence) {
+      pos++;
+      continue;
+    }
+
+    int matchEnd = pos + MIN_MATCH;
+    while (matchEnd < matchEndLimit && src[matchEnd] == src[candidate + (matchEnd - pos)]) {
+      matchEnd++;
+    }
+
+    int literalLength = pos - anchor;
+    int matchLength = matchEnd - pos - MIN_MATCH;
+    int worstCase = 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1;
+    if (out + worstCase > outEnd) {
+      return 0;
+    }
+
+    unsigned char *token = out++;
+    *token = (unsigned char) ((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15) {
+      out = writeLength(out, literalLength - 15);
+    }
+    memcpy(out, src + anchor, literalLength);
+    out += literalLength;
+
+    int offset = pos - candidate;
+    *out++ = (unsigned char) (offset & 0xff);
+    *out++ = (unsigned char) (offset >> 8);
+
+    *token |= (unsigned char) (matchLength >= 15 ? 15 : matchLength);
+    if (matchLength >= 15) {
+      out = writeLength(out, matchLength - 15);
+    }
+
+    pos = matchEnd;
+    anchor = pos;
+  }
+
+  // the final sequence is literals only
+  int literalLength = sourceSize - anchor;
+  int worstCase = 1 + literalLength / 255 + 1 + literalLength;
+  if (out + worstCase > outEnd) {
+    return 0;
+  }
+  *out++ = (unsigned char) ((literalLength >= 15 ? 15 : literalLength) << 4);
+  if (literalLength >= 15) {
+    out = writeLength(out, literalLength - 15);
+  }
+  memcpy(out, src + anchor, literalLength);
+  out += literalLength;
+
+  return out - (unsigned char *) dest;
+}
+
+int BlockCompressor::decompress(const char *source, int sourceSize, char *dest, int destSize) {
+  const unsigned char *in = (const unsigned char *) source;
+  const unsigned char *inEnd = in + sourceSize;
+  unsigned char *out = (unsigned char *) dest;
+  unsigned char *outEnd = out + destSize;
+
+  while (in < inEnd) {
+    unsigned char token = *in++;
+
+    int literalLength = token >> 4;
+    if (literalLength == 15) {
+      unsigned char extra;
+      do {
+        if (in >= inEnd) {
+          return -1;
+        }
+        extra = *in++;
+        literalLength += extra;
+      } while (extra == 255);
+    }
+    if (literalLength > inEnd - in || literalLength > outEnd - out) {
+      return -1;
+    }
+    memcpy(out, in, literalLength);
+    in += literalLength;
+    out += literalLength;
+
+    if (in == inEnd) {
+      break;
+    }
+
+    if (inEnd - in < 2) {
+      return -1;
+    }
+    int offset = in[0] | (in[1] << 8);
+    in += 2;
+    if (offset == 0 || offset > out - (unsigned char *) dest) {
+      return -1;
+    }
+
+    int matchLength = token & 0xf;
+    if (matchLength == 15) {
+      unsigned char extra;
+      do {
+        if (in >= inEnd) {
+          return -1;
+        }
+        extra = *in++;
+        matchLength += extra;
+      } while (extra == 255);
+    }
+    matchLength += MIN_MATCH;
+    if (matchLength > outEnd - out) {
+      return -1;
+    }
+
+    // byte at a time because the match may overlap what it is producing
+    const unsigned char *match = out - offset;
+    for (int i = 0; i < matchLength; i++) {
+      out[i] = match[i];
+    }
+    out += matchLength;
+  }
+
+  return out - (unsigned char *) dest;
+}
@@ -3,7 +3,9 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
@@ -14,10 +16,14 @@
 
 using namespace std;
 
-Disk::Disk(string imageFile, int blockSize) {
+// 4 MiB of 4 KiB blocks
+#define DISK_CACHE_BLOCKS (1024)
+
+Disk::Disk(string imageFile, int blockSize, bool locked) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
   this->isInTransaction = false;
+  this->syncPending = false;
   
   struct stat stat;
   int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
@@ -30,7 +36,14 @@ Disk::Disk(string imageFile, int blockSize) {
     cerr << "Could not stat image file" << endl;
     exit(1);
   }
-  close(imageFileDescriptor);
+  // the descriptor stays open for the flock
+  this->lockFd = imageFileDescriptor;
+  this->locked = locked;
+  this->exclusive = false;
+  if (locked && flock(this->lockFd, LOCK_SH | LOCK_NB) != 0) {
+    cerr << imageFile << " is being written by another process" << endl;
+    exit(1);
+  }
   
   this->imageFileSize = stat.st_size;
 
@@ -41,34 +54,135 @@ Disk::Disk(string imageFile, int blockSize) {
     cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
     exit(1);
   }
-  
+
+  this->cacheCapacity = DISK_CACHE_BLOCKS;
+  memset(&this->counters, 0, sizeof(this->counters));
+  this->readaheadStarted = false;
+  this->stopping = false;
+  pthread_mutex_init(&this->cacheLock, NULL);
+  pthread_cond_init(&this->blockReady, NULL);
+  pthread_cond_init(&this->readaheadPending, NULL);
+}
+
+Disk::~Disk() {
+  pthread_mutex_lock(&cacheLock);
+  stopping = true;
+  pthread_cond_broadcast(&readaheadPending);
+  pthread_mutex_unlock(&cacheLock);
+  if (readaheadStarted) {
+    pthread_join(readaheadThread, NULL);
+  }
+
+  unordered_map<int, CachedBlock>::iterator iter;
+  for (iter = cache.begin(); iter != cache.end(); iter++) {
+    delete [] iter->second.data;
+  }
+  pthread_cond_destroy(&readaheadPending);
+  pthread_cond_destroy(&blockReady);
+  pthread_mutex_destroy(&cacheLock);
+  // closing drops the flock
+  close(lockFd);
+}
+
+bool Disk::lockExclusive() {
+  if (locked && !exclusive) {
+    // Converting a flock isn't atomic, but nobody can have written while
+    // we held the shared lock, and if another Disk gets in first the
+    // upgrade fails and we don't write at all
+    exclusive = flock(lockFd, LOCK_EX | LOCK_NB) == 0;
+  }
+  return exclusive;
+}
+
+void Disk::requireExclusive() {
+  if (!locked) {
+    cerr << this->imageFile << " was opened to read a snapshot and can't be written" << endl;
+    exit(1);
+  }
+  if (!lockExclusive()) {
+    cerr << this->imageFile << " is in use by another process" << endl;
+    exit(1);
+  }
 }
 
 int Disk::numberOfBlocks() {
   return this->imageFileSize / this->blockSize;
 }
 
+void Disk::extend(int numberOfBlocks) {
+  if (numberOfBlocks <= this->numberOfBlocks()) {
+    return;
+  }
+  requireExclusive();
+
+  int fd = open(this->imageFile.c_str(), O_RDWR);
+  if (fd < 0) {
+    cerr << "Could not open image file " << this->imageFile << endl;
+    exit(1);
+  }
+
+  off_t size = (off_t) numberOfBlocks * this->blockSize;
+  if (ftruncate(fd, size) != 0) {
+    perror("extend::ftruncate");
+    cerr << "Could not extend image file" << endl;
+    exit(1);
+  }
+  fsync(fd);
+  close(fd);
+  this->imageFileSize = size;
+  pthread_mutex_lock(&cacheLock);
+  counters.syncs++;
+  pthread_mutex_unlock(&cacheLock);
+}
+
 void Disk::readBlock(int blockNumber, void *buffer) {
   if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
+  pthread_mutex_lock(&cacheLock);
+  unordered_map<int, CachedBlock>::iterator iter = cache.find(blockNumber);
+  // a readahead in flight finishes sooner than a read of our own
+  while (iter != cache.end() && !iter->second.ready) {
+    pthread_cond_wait(&blockReady, &cacheLock);
+    iter = cache.find(blockNumber);
+  }
+  if (iter != cache.end()) {
+    memcpy(buffer, iter->second.data, this->blockSize);
+    lru.splice(lru.begin(), lru, iter->second.lruPosition);
+    counters.cacheHits++;
+    pthread_mutex_unlock(&cacheLock);
+    return;
+  }
+  counters.blockReads++;
+  pthread_mutex_unlock(&cacheLock);
+
+  readFromImage(blockNumber, buffer);
+
+  // a write that raced with us has already put newer data in the cache
+  pthread_mutex_lock(&cacheLock);
+  if (cache.find(blockNumber) == cache.end()) {
+    cacheInsert(blockNumber, buffer, true);
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+void Disk::readFromImage(int blockNumber, void *buffer) {
   int fd = open(this->imageFile.c_str(), O_RDONLY);
   if (fd < 0) {
     cerr << "Could not open image file " << this->imageFile << endl;
     exit(1);
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  if (lseek(fd, offset, SEEK_SET) != offset) {
     perror("read::lseek");
     cerr << "Could not seek to file" << endl;
     exit(1);
   }
 
-  ret = read(fd, buffer, this->blockSize);
+  int ret = read(fd, buffer, this->blockSize);
   if (ret != this->blockSize) {
     cerr << "Could not read file" << endl;
     exit(1);
@@ -77,11 +191,47 @@ void Disk::readBlock(int blockNumber, void *buffer) {
   close(fd);
 }
 
+void Disk::readBlocks(int blockNumber, int count, void *buffer) {
+  if (count <= 0) {
+    return;
+  }
+  if (blockNumber < 0 || count > this->numberOfBlocks() - blockNumber) {
+    cerr << "Invalid block range " << blockNumber << " + " << count << endl;
+    exit(1);
+  }
+
+  int fd = open(this->imageFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open image file " << this->imageFile << endl;
+    exit(1);
+  }
+
+  pthread_mutex_lock(&cacheLock);
+  counters.blockReads += count;
+  pthread_mutex_unlock(&cacheLock);
+
+  // pread keeps this safe to call from several threads at once
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  size_t length = (size_t) count * this->blockSize;
+  size_t done = 0;
+  while (done < length) {
+    ssize_t ret = pread(fd, (char *) buffer + done, length - done, offset + done);
+    if (ret <= 0) {
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
+    done += ret;
+  }
+
+  close(fd);
+}
+
 void Disk::writeBlock(int blockNumber, void *buffer) {  
   if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
+  requireExclusive();
 
   if (isInTransaction) {
     struct UndoRecord undoRecord;
@@ -97,21 +247,162 @@ void Disk::writeBlock(int blockNumber, void *buffer) {
     exit(1);
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  if (lseek(fd, offset, SEEK_SET) != offset) {
     perror("write::lseek");
     cerr << "Could not seek to file" << endl;
     exit(1);
   }
 
-  ret = write(fd, buffer, this->blockSize);
+  int ret = write(fd, buffer, this->blockSize);
   if (ret != this->blockSize) {
     cerr << "Could not write file" << endl;
     exit(1);
   }
-  fsync(fd);
+  // a transaction syncs once, at commit
+  if (isInTransaction) {
+    syncPending = true;
+  } else {
+    fsync(fd);
+  }
   close(fd);
+
+  // write-through: wait out a readahead of the old contents, then replace it
+  pthread_mutex_lock(&cacheLock);
+  counters.blockWrites++;
+  if (!isInTransaction) {
+    counters.syncs++;
+  }
+  unordered_map<int, CachedBlock>::iterator iter = cache.find(blockNumber);
+  while (iter != cache.end() && !iter->second.ready) {
+    pthread_cond_wait(&blockReady, &cacheLock);
+    iter = cache.find(blockNumber);
+  }
+  if (iter != cache.end()) {
+    memcpy(iter->second.data, buffer, this->blockSize);
+    lru.splice(lru.begin(), lru, iter->second.lruPosition);
+  } else {
+    cacheInsert(blockNumber, buffer, true);
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+void Disk::prefetch(const vector<int> &blocks) {
+  pthread_mutex_lock(&cacheLock);
+  if (cacheCapacity == 0) {
+    // nowhere to put what we'd read
+    pthread_mutex_unlock(&cacheLock);
+    return;
+  }
+  if (!readaheadStarted) {
+    if (pthread_create(&readaheadThread, NULL, readaheadWorker, this) != 0) {
+      // readahead is only an optimization
+      pthread_mutex_unlock(&cacheLock);
+      return;
+    }
+    readaheadStarted = true;
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    int blockNumber = blocks[i];
+    if (blockNumber < 0 || blockNumber >= this->numberOfBlocks() ||
+        cache.find(blockNumber) != cache.end() || (int) readaheadQueue.size() >= cacheCapacity) {
+      continue;
+    }
+    readaheadQueue.push_back(blockNumber);
+  }
+  pthread_cond_signal(&readaheadPending);
+  pthread_mutex_unlock(&cacheLock);
+}
+
+bool Disk::isCached(int blockNumber) {
+  pthread_mutex_lock(&cacheLock);
+  bool cached = cache.find(blockNumber) != cache.end();
+  pthread_mutex_unlock(&cacheLock);
+  return cached;
+}
+
+void *Disk::readaheadWorker(void *arg) {
+  Disk *disk = (Disk *) arg;
+  unsigned char *buffer = new unsigned char[disk->blockSize];
+
+  pthread_mutex_lock(&disk->cacheLock);
+  while (!disk->stopping) {
+    if (disk->readaheadQueue.empty()) {
+      pthread_cond_wait(&disk->readaheadPending, &disk->cacheLock);
+      continue;
+    }
+    int blockNumber = disk->readaheadQueue.front();
+    disk->readaheadQueue.pop_front();
+    if (disk->cache.find(blockNumber) != disk->cache.end()) {
+      continue;
+    }
+
+    // the placeholder makes readers wait for us rather than read it too
+    disk->cacheInsert(blockNumber, NULL, false);
+    disk->counters.readaheadReads++;
+    pthread_mutex_unlock(&disk->cacheLock);
+    disk->readFromImage(blockNumber, buffer);
+    pthread_mutex_lock(&disk->cacheLock);
+
+    unordered_map<int, CachedBlock>::iterator iter = disk->cache.find(blockNumber);
+    if (iter != disk->cache.end() && !iter->second.ready) {
+      memcpy(iter->second.data, buffer, disk->blockSize);
+      iter->second.ready = true;
+    }
+    pthread_cond_broadcast(&disk->blockReady);
+  }
+  pthread_mutex_unlock(&disk->cacheLock);
+
+  delete [] buffer;
+  return NULL;
+}
+
+void Disk::cacheInsert(int blockNumber, const void *buffer, bool ready) {
+  CachedBlock block;
+  block.data = new unsigned char[this->blockSize];
+  if (buffer != NULL) {
+    memcpy(block.data, buffer, this->blockSize);
+  }
+  block.ready = ready;
+  lru.push_front(blockNumber);
+  block.lruPosition = lru.begin();
+  cache[blockNumber] = block;
+  cacheEvict();
+}
+
+void Disk::cacheEvict() {
+  // blocks still being read ahead stay put, the worker fills them in
+  list<int>::iterator victim = lru.end();
+  while ((int) cache.size() > cacheCapacity && victim != lru.begin()) {
+    victim--;
+    unordered_map<int, CachedBlock>::iterator iter = cache.find(*victim);
+    if (!iter->second.ready) {
+      continue;
+    }
+    delete [] iter->second.data;
+    cache.erase(iter);
+    victim = lru.erase(victim);
+  }
+}
+
+void Disk::setCacheCapacity(int blocks) {
+  pthread_mutex_lock(&cacheLock);
+  cacheCapacity = blocks < 0 ? 0 : blocks;
+  cacheEvict();
+  pthread_mutex_unlock(&cacheLock);
+}
+
+DiskStats Disk::stats() {
+  pthread_mutex_lock(&cacheLock);
+  DiskStats copy = counters;
+  pthread_mutex_unlock(&cacheLock);
+  return copy;
+}
+
+void Disk::resetStats() {
+  pthread_mutex_lock(&cacheLock);
+  memset(&counters, 0, sizeof(counters));
+  pthread_mutex_unlock(&cacheLock);
 }
 
 void Disk::beginTransaction() {
@@ -119,11 +410,25 @@ void Disk::beginTransaction() {
     cerr << "You can't start a new transaction: one already exists" << endl;
     exit(1);
   }
+  requireExclusive();
   isInTransaction = true;
 }
 
 void Disk::commit() {
   isInTransaction = false;
+  if (syncPending) {
+    int fd = open(this->imageFile.c_str(), O_RDWR);
+    if (fd < 0) {
+      cerr << "Could not open image file " << this->imageFile << endl;
+      exit(1);
+    }
+    fsync(fd);
+    close(fd);
+    syncPending = false;
+    pthread_mutex_lock(&cacheLock);
+    counters.syncs++;
+    pthread_mutex_unlock(&cacheLock);
+  }
   deque<struct UndoRecord>::iterator iter;
   for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
     delete [] iter->blockData;
@@ -133,6 +438,7 @@ void Disk::commit() {
 
 void Disk::rollback() {
   isInTransaction = false;
+  syncPending = false;
   deque<struct UndoRecord>::iterator iter;
   for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
     this->writeBlock(iter->blockNumber, iter->blockData);
@@ -6,27 +6,392 @@
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
 #include <algorithm>
+#include <cstring>
+#include <ctime>
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
 #include "ufs.h"
+#include "StringUtils.h"
 #include "WwwFormEncodedDict.h"
 
 using namespace std;
 
+// Read-only snapshots are exposed as /ds3/.snapshots/<name>/...
+#define SNAPSHOT_DIR ".snapshots"
+
+// sizeHint() remembers at most this many paths
+#define SIZE_HINT_ENTRIES (4096)
+
+// Regular files bigger than this are streamed, this many bytes per chunk
+#define STREAM_CHUNK_BYTES (8 * UFS_BLOCK_SIZE)
+
+// Holds the service's lock until it goes out of scope, including when a
+// ClientError is thrown. unlock() lets go early, e.g. while writing to a
+// slow client, and lock() takes it back.
+class FileSystemGuard {
+ public:
+  FileSystemGuard(pthread_mutex_t *mutex) : mutex(mutex), locked(false) { lock(); }
+  ~FileSystemGuard() {
+    if (locked) {
+      pthread_mutex_unlock(mutex);
+    }
+  }
+  void lock() {
+    pthread_mutex_lock(mutex);
+    locked = true;
+  }
+  void unlock() {
+    pthread_mutex_unlock(mutex);
+    locked = false;
+  }
+
+ private:
+  pthread_mutex_t *mutex;
+  bool locked;
+};
+
 DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+  Disk *disk = new Disk(diskFile, UFS_BLOCK_SIZE);
+  // we write for as long as we run, so refuse other writers from the start
+  if (!disk->lockExclusive()) {
+    cerr << diskFile << " is in use by another process" << endl;
+    exit(1);
+  }
+  this->fileSystem = new LocalFileSystem(disk);
+  pthread_mutex_init(&this->fileSystemLock, NULL);
+  pthread_mutex_init(&this->sizeHintLock, NULL);
+  // versions restart at 0, so tags from an earlier run must not match
+  this->bootId = ((unsigned long long) time(NULL) << 20) ^ getpid();
+  this->nextVersion = 0;
 }  
 
+int DistributedFileSystemService::resolvePath(LocalFileSystem *fs, vector<string> &components, size_t start) {
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  for (size_t i = start; i < components.size(); i++) {
+    inodeNumber = fs->lookup(inodeNumber, components[i]);
+    if (inodeNumber < 0) {
+      throw ClientError::notFound();
+    }
+  }
+  return inodeNumber;
+}
+
+string DistributedFileSystemService::readEntity(LocalFileSystem *fs, int inodeNumber) {
+  inode_t inode;
+  if (fs->stat(inodeNumber, &inode) < 0) {
+    throw ClientError::notFound();
+  }
+
+  string contents(inode.size, '\0');
+  int bytesRead = fs->read(inodeNumber, &contents[0], inode.size);
+  if (bytesRead < 0) {
+    throw ClientError::badRequest();
+  }
+  contents.resize(bytesRead);
+  if (inode.type == UFS_REGULAR_FILE) {
+    return contents;
+  }
+
+  vector<string> names;
+  const dir_ent_t *entries = (const dir_ent_t *) contents.data();
+  for (int i = 0; i < bytesRead / (int) sizeof(dir_ent_t); i++) {
+    if (strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) {
+      continue;
+    }
+    inode_t entryInode;
+    if (fs->stat(entries[i].inum, &entryInode) < 0) {
+      continue;
+    }
+    names.push_back(string(entries[i].name) + (entryInode.type == UFS_DIRECTORY ? "/" : ""));
+  }
+  sort(names.begin(), names.end());
+
+  string listing;
+  for (const auto &name : names) {
+    listing += name + "\n";
+  }
+  return listing;
+}
+
+// ufs keeps no modification times, but while we run no other process
+// can write the image (we hold its exclusive lock), so every change goes
+// through us and we number versions of each object ourselves. A tag only
+// goes stale when its own object changes, and checking one reads nothing
+// from disk.
+string DistributedFileSystemService::etag(const string &snapshot, int inodeNumber) {
+  char tag[96];
+  if (snapshot.empty()) {
+    unordered_map<int, unsigned long long>::iterator iter = versions.find(inodeNumber);
+    unsigned long long version = iter == versions.end() ? 0 : iter->second;
+    snprintf(tag, sizeof(tag), "\"%llx-%llx-%x\"", bootId, version, inodeNumber);
+  } else {
+    // a name can be deleted and taken again, so number each snapshot too
+    unordered_map<string, unsigned long long>::iterator iter = snapshotVersions.find(snapshot);
+    if (iter == snapshotVersions.end()) {
+      iter = snapshotVersions.insert(make_pair(snapshot, ++nextVersion)).first;
+    }
+    snprintf(tag, sizeof(tag), "\"%llx-s%llx-%x\"", bootId, iter->second, inodeNumber);
+  }
+  return tag;
+}
+
+// numbers are never reused, so a freed inode that's allocated again
+// doesn't come back with a tag it had before
+void DistributedFileSystemService::changed(int inodeNumber) {
+  versions[inodeNumber] = ++nextVersion;
+}
+
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
-  response->setBody("");
+  FileSystemGuard guard(&fileSystemLock);
+  vector<string> components = request->getPathComponents();
+
+  // components[0] is "ds3"
+  if (components.size() < 2 || components[1] != SNAPSHOT_DIR) {
+    int inodeNumber = resolvePath(fileSystem, components, 1);
+    sendInode(request, response, fileSystem, "", inodeNumber, guard);
+    return;
+  }
+
+  if (components.size() == 2) {
+    string tag = etag("", -1);
+    if (notModified(request, response, tag, -1)) {
+      return;
+    }
+    vector<snapshot_t> snapshots;
+    if (fileSystem->listSnapshots(&snapshots) < 0) {
+      throw ClientError::notFound();
+    }
+    vector<string> names;
+    for (const auto &snapshot : snapshots) {
+      names.push_back(string(snapshot.name) + "/");
+    }
+    sort(names.begin(), names.end());
+    string listing;
+    for (const auto &name : names) {
+      listing += name + "\n";
+    }
+    sendEntity(request, response, listing, tag);
+    return;
+  }
+
+  // a separate view so the live file system stays writable
+  LocalFileSystem snapshotView(fileSystem->disk);
+  if (snapshotView.openSnapshot(components[2]) < 0) {
+    throw ClientError::notFound();
+  }
+  int inodeNumber = resolvePath(&snapshotView, components, 3);
+  sendInode(request, response, &snapshotView, components[2], inodeNumber, guard);
+}
+
+void DistributedFileSystemService::sendInode(HTTPRequest *request, HTTPResponse *response, LocalFileSystem *fs,
+                                             const string &snapshot, int inodeNumber, FileSystemGuard &guard) {
+  inode_t inode;
+  if (fs->stat(inodeNumber, &inode) < 0) {
+    throw ClientError::notFound();
+  }
+  string tag = etag(snapshot, inodeNumber);
+  if (notModified(request, response, tag, -1)) {
+    return;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    string listing = readEntity(fs, inodeNumber);
+    rememberSize(request->getPath(), listing.size());
+    sendEntity(request, response, listing, tag);
+    return;
+  }
+  rememberSize(request->getPath(), inode.size);
+
+  vector<ByteRange> ranges = requestedRanges(request, response, inode.size, tag, -1);
+  if (!ranges.empty()) {
+    setPartialBody(response, ranges, inode.size, [fs, inodeNumber](long long offset, long long length) {
+      string part(length, '\0');
+      int ret = fs->readAt(inodeNumber, &part[0], offset, length);
+      part.resize(max(ret, 0));
+      return part;
+    });
+  } else if (inode.size <= STREAM_CHUNK_BYTES || !request->acceptsChunked()) {
+    // an HTTP/1.0 client can't take a chunked body, so it gets the whole
+    // file with a Content-Length
+    response->setBody(readEntity(fs, inodeNumber));
+  } else {
+    streamFile(response, fs, snapshot, inodeNumber, inode.size, tag, guard);
+  }
+}
+
+void DistributedFileSystemService::streamFile(HTTPResponse *response, LocalFileSystem *fs, const string &snapshot,
+                                              int inodeNumber, int size, const string &tag, FileSystemGuard &guard) {
+  vector<char> chunk(STREAM_CHUNK_BYTES);
+  response->withStreaming();
+  for (int offset = 0; offset < size; offset += STREAM_CHUNK_BYTES) {
+    // writes to other files leave the tag alone; only this file changing
+    // or being freed, or its snapshot being deleted, moves it
+    if (etag(snapshot, inodeNumber) != tag) {
+      // changed while we were writing: the headers are already out, so
+      // all we can do is cut the body short
+      throw ClientError::conflict();
+    }
+    int ret = fs->readAt(inodeNumber, &chunk[0], offset, STREAM_CHUNK_BYTES);
+    if (ret <= 0) {
+      throw ClientError::badRequest();
+    }
+    // other requests can use the file system while this one waits on
+    // the client
+    guard.unlock();
+    response->writeChunk(&chunk[0], ret);
+    guard.lock();
+  }
+}
+
+void DistributedFileSystemService::sendEntity(HTTPRequest *request, HTTPResponse *response, const string &entity,
+                                              const string &tag) {
+  vector<ByteRange> ranges = requestedRanges(request, response, entity.size(), tag, -1);
+  if (ranges.empty()) {
+    response->setBody(entity);
+  } else {
+    setPartialBody(response, ranges, entity.size(),
+                   [&entity](long long offset, long long length) { return entity.substr(offset, length); });
+  }
 }
 
 void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+  FileSystemGuard guard(&fileSystemLock);
+  forgetSizes();
+  vector<string> components = request->getPathComponents();
+  if (components.size() >= 2 && components[1] == SNAPSHOT_DIR) {
+    // PUT /ds3/.snapshots/<name> takes a snapshot; snapshots are read-only
+    if (components.size() != 3) {
+      throw ClientError::badRequest();
+    }
+    fileSystem->disk->beginTransaction();
+    int ret = fileSystem->createSnapshot(components[2]);
+    if (ret < 0) {
+      fileSystem->disk->rollback();
+      if (ret == -ENOTENOUGHSPACE) {
+        throw ClientError::insufficientStorage();
+      } else if (ret == -EINVALIDNAME) {
+        throw ClientError::conflict();
+      }
+      throw ClientError::badRequest();
+    }
+    fileSystem->disk->commit();
+    changed(-1);
+    response->setBody("");
+    return;
+  }
+
   response->setBody("");
 }
 
 void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
+  FileSystemGuard guard(&fileSystemLock);
+  forgetSizes();
+  vector<string> components = request->getPathComponents();
+  if (components.size() >= 2 && components[1] == SNAPSHOT_DIR) {
+    if (components.size() != 3) {
+      throw ClientError::badRequest();
+    }
+    fileSystem->disk->beginTransaction();
+    if (fileSystem->deleteSnapshot(components[2]) < 0) {
+      fileSystem->disk->rollback();
+      throw ClientError::notFound();
+    }
+    fileSystem->disk->commit();
+    changed(-1);
+    snapshotVersions.erase(components[2]);
+    response->setBody("");
+    return;
+  }
+
   response->setBody("");
 }
+
+void DistributedFileSystemService::move(HTTPRequest *request, HTTPResponse *response) {
+  FileSystemGuard guard(&fileSystemLock);
+  forgetSizes();
+  // MOVE /ds3/a/b.txt with "Destination: /ds3/c/d.txt" (or a full URL)
+  string destination;
+  try {
+    destination = request->getHeader("Destination");
+  } catch (...) {
+    throw ClientError::badRequest();
+  }
+  size_t scheme = destination.find("://");
+  if (scheme != string::npos) {
+    size_t pathStart = destination.find('/', scheme + 3);
+    destination = pathStart == string::npos ? "/" : destination.substr(pathStart);
+  }
+
+  vector<string> src = request->getPathComponents();
+  vector<string> dst = StringUtils::split(destination, '/');
+  if (src.size() < 2 || dst.size() < 2 || dst[0] != src[0]) {
+    throw ClientError::badRequest();
+  }
+  if (src[1] == SNAPSHOT_DIR || dst[1] == SNAPSHOT_DIR) {
+    throw ClientError::forbidden();
+  }
+
+  string srcName = src.back();
+  string dstName = dst.back();
+  src.pop_back();
+  dst.pop_back();
+  int srcParent = resolvePath(fileSystem, src, 1);
+  int dstParent = resolvePath(fileSystem, dst, 1);
+
+  int moved = fileSystem->lookup(srcParent, srcName);
+  int replaced = fileSystem->lookup(dstParent, dstName);
+
+  // replacing an existing destination unlinks it first
+  fileSystem->disk->beginTransaction();
+  int ret = fileSystem->rename(srcParent, srcName, dstParent, dstName);
+  if (ret < 0) {
+    fileSystem->disk->rollback();
+    if (ret == -ENOTFOUND) {
+      throw ClientError::notFound();
+    } else if (ret == -ENOTENOUGHSPACE) {
+      throw ClientError::insufficientStorage();
+    } else if (ret == -EINVALIDTYPE || ret == -EDIRNOTEMPTY) {
+      throw ClientError::conflict();
+    }
+    throw ClientError::badRequest();
+  }
+  fileSystem->disk->commit();
+  // what moved reads the same (listings leave out ".."); the two listings
+  // and whatever it replaced don't
+  changed(srcParent);
+  changed(dstParent);
+  if (replaced >= 0 && replaced != moved) {
+    changed(replaced);
+  }
+  response->setBody("");
+}
+
+// Only what earlier GETs saw: the event loop calls this, and taking
+// fileSystemLock here would stall it behind whatever request holds it.
+long long DistributedFileSystemService::sizeHint(string path) {
+  long long size = -1;
+  pthread_mutex_lock(&sizeHintLock);
+  unordered_map<string, long long>::iterator iter = sizeHints.find(path);
+  if (iter != sizeHints.end()) {
+    size = iter->second;
+  }
+  pthread_mutex_unlock(&sizeHintLock);
+  return size;
+}
+
+void DistributedFileSystemService::rememberSize(const string &path, long long size) {
+  pthread_mutex_lock(&sizeHintLock);
+  if (sizeHints.size() >= SIZE_HINT_ENTRIES) {
+    sizeHints.clear();
+  }
+  sizeHints[path] = size;
+  pthread_mutex_unlock(&sizeHintLock);
+}
+
+void DistributedFileSystemService::forgetSizes() {
+  pthread_mutex_lock(&sizeHintLock);
+  sizeHints.clear();
+  pthread_mutex_unlock(&sizeHintLock);
+}
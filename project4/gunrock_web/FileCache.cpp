@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "FileCache.h"
+
+using namespace std;
+
+FileCache::FileCache(long long capacityBytes) : capacityBytes(capacityBytes) {
+  pthread_mutex_init(&lock, NULL);
+  memset(&counters, 0, sizeof(counters));
+}
+
+FileCache::~FileCache() {
+  pthread_mutex_destroy(&lock);
+}
+
+bool FileCache::matches(const Entry &entry, const struct stat &st) {
+  return entry.inode == st.st_ino && entry.size == st.st_size && entry.mtime.tv_sec == st.st_mtim.tv_sec &&
+         entry.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+void FileCache::erase(unordered_map<string, Entry>::iterator iter) {
+  counters.bytes -= entryBytes(*iter->second.file);
+  counters.entries--;
+  recent.erase(iter->second.position);
+  entries.erase(iter);
+}
+
+shared_ptr<const CachedFile> FileCache::lookup(const string &path, const struct stat &st) {
+  shared_ptr<const CachedFile> file;
+  pthread_mutex_lock(&lock);
+  unordered_map<string, Entry>::iterator iter = entries.find(path);
+  if (iter == entries.end()) {
+    counters.misses++;
+  } else if (!matches(iter->second, st)) {
+    counters.misses++;
+    counters.stale++;
+    erase(iter);
+  } else {
+    counters.hits++;
+    recent.splice(recent.begin(), recent, iter->second.position);
+    file = iter->second.file;
+  }
+  pthread_mutex_unlock(&lock);
+  return file;
+}
+
+void FileCache::insert(const string &path, const struct stat &st, shared_ptr<const CachedFile> file) {
+  long long bytes = entryBytes(*file);
+  if (bytes > maxEntryBytes()) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  unordered_map<string, Entry>::iterator iter = entries.find(path);
+  if (iter != entries.end()) {
+    // another worker got here first, or the file changed again
+    erase(iter);
+  }
+  while (!recent.empty() && counters.bytes + bytes > capacityBytes) {
+    erase(entries.find(recent.back()));
+    counters.evictions++;
+  }
+
+  recent.push_front(path);
+  Entry &entry = entries[path];
+  entry.file = file;
+  entry.inode = st.st_ino;
+  entry.size = st.st_size;
+  entry.mtime = st.st_mtim;
+  entry.position = recent.begin();
+  counters.bytes += bytes;
+  counters.entries++;
+  pthread_mutex_unlock(&lock);
+}
+
+FileCacheStats FileCache::stats() {
+  pthread_mutex_lock(&lock);
+  FileCacheStats copy = counters;
+  pthread_mutex_unlock(&lock);
+  return copy;
+}
@@ -2,17 +2,20 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "FileService.h"
 #include "ClientError.h"
+#include "HttpUtils.h"
 
 using namespace std;
 
-FileService::FileService(string basedir) : HttpService("/") {
+FileService::FileService(string basedir, long long cacheBytes) : HttpService("/") {
   while (endswith(basedir, "/")) {
     basedir = basedir.substr(0, basedir.length() - 1);
   }
@@ -23,6 +26,7 @@ FileService::FileService(string basedir) : HttpService("/") {
   }
   
   this->m_basedir = basedir;
+  this->m_cache = cacheBytes > 0 ? new FileCache(cacheBytes) : NULL;
 }
 
 bool FileService::endswith(string str, string suffix) {
@@ -30,37 +34,134 @@ bool FileService::endswith(string str, string suffix) {
   return pos == (str.length() - suffix.length());
 }
 
+string FileService::contentType(string path) {
+  if (this->endswith(path, ".css")) {
+    return "text/css";
+  } else if (this->endswith(path, ".js")) {
+    return "text/javascript";
+  }
+  return "text/html; charset=ISO-8859-1";
+}
+
 void FileService::get(HTTPRequest *request, HTTPResponse *response) {
   string path = this->m_basedir + request->getPath();
-  string fileContents = this->readFile(path);
-  if (fileContents.size() == 0) {
+  struct stat st;
+
+  // a stat is all a cache hit costs
+  if (m_cache != NULL && stat(path.c_str(), &st) == 0) {
+    shared_ptr<const CachedFile> file = m_cache->lookup(path, st);
+    if (file) {
+      if (!request->hasHeader("If-None-Match") && !request->hasHeader("If-Modified-Since") &&
+          !request->hasHeader("Range")) {
+        // the common case: headers and body exactly as cached
+        response->setEntityHeaders(file->headers);
+        response->setBody(file->contents);
+        return;
+      }
+      response->setContentType(file->contentType);
+      if (notModified(request, response, this->etag(st), st.st_mtime)) {
+        return;
+      }
+      vector<ByteRange> ranges = requestedRanges(request, response, st.st_size, this->etag(st), st.st_mtime);
+      if (ranges.empty()) {
+        response->setBody(file->contents);
+      } else {
+        setPartialBody(response, ranges, st.st_size,
+                       [&file](long long offset, long long length) { return file->contents.substr(offset, length); });
+      }
+      return;
+    }
+  }
+
+  int fd = this->openFile(path, &st);
+  if (fd < 0) {
     throw ClientError::notFound();
-  } else {
-    if (this->endswith(path, ".css")) {
-      response->setContentType("text/css");
-    } else if (this->endswith(path, ".js")) {
-      response->setContentType("text/javascript");
+  }
+  response->setContentType(this->contentType(path));
+  if (notModified(request, response, this->etag(st), st.st_mtime)) {
+    close(fd);
+    return;
+  }
+  vector<ByteRange> ranges;
+  try {
+    ranges = requestedRanges(request, response, st.st_size, this->etag(st), st.st_mtime);
+  } catch (ClientError &) {
+    close(fd);
+    throw;
+  }
+  if (ranges.size() == 1) {
+    // one range still goes straight from the page cache
+    long long length = ranges[0].last - ranges[0].first + 1;
+    response->setStatus(206);
+    response->setHeader("Content-Range", "bytes " + to_string(ranges[0].first) + "-" + to_string(ranges[0].last) +
+                                             "/" + to_string(st.st_size));
+    response->setBodyFile(fd, ranges[0].first, length);
+    return;
+  } else if (ranges.size() > 1) {
+    setPartialBody(response, ranges, st.st_size, [fd](long long offset, long long length) {
+      string part(length, '\0');
+      ssize_t ret = pread(fd, &part[0], length, offset);
+      part.resize(ret < 0 ? 0 : ret);
+      return part;
+    });
+    close(fd);
+    return;
+  }
+
+  if (m_cache != NULL && st.st_size <= m_cache->maxEntryBytes()) {
+    string contents;
+    int ret;
+    char buffer[16384];
+    while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
+      contents.append(buffer, ret);
+    }
+    close(fd);
+    // st came from the open file, so a change since then shows up as stale
+    if (ret == 0 && (off_t) contents.size() == st.st_size) {
+      shared_ptr<CachedFile> file(new CachedFile());
+      file->contents = contents;
+      file->contentType = this->contentType(path);
+      file->headers = this->entityHeaders(st, file->contentType);
+      m_cache->insert(path, st, file);
     }
-    response->setBody(fileContents);
+    response->setBody(contents);
+  } else {
+    // the worker sendfile()s it to the client, no copies in between
+    response->setBodyFile(fd, 0, st.st_size);
   }
 }
 
-string FileService::readFile(string path) {
-  int fd = open(path.c_str(), O_RDONLY);
+// What a plain 200 for the file says about its body, built once when it
+// is cached: the same headers notModified() and requestedRanges() set
+// plus the ones response() would work out
+string FileService::entityHeaders(const struct stat &st, const string &contentType) {
+  return "Accept-Ranges: bytes\r\n"
+         "Content-Length: " + to_string((long long) st.st_size) + "\r\n" +
+         "Content-Type: " + contentType + "\r\n" +
+         "ETag: " + this->etag(st) + "\r\n" +
+         "Last-Modified: " + HttpUtils::httpDate(st.st_mtime) + "\r\n";
+}
+
+// Strong: it changes whenever the file is replaced, resized or written
+string FileService::etag(const struct stat &st) {
+  char text[96];
+  snprintf(text, sizeof(text), "\"%llx-%llx-%llx.%lx\"", (unsigned long long) st.st_ino,
+           (unsigned long long) st.st_size, (unsigned long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+  return text;
+}
+
+// Opens a regular, non-empty file for reading, -1 for anything else
+int FileService::openFile(string path, struct stat *st) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
   if (fd < 0) {
-    return "";
+    return -1;
   }
 
-  string result;
-  int ret;
-  char buffer[4096];
-  while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
-    result.append(buffer, ret);
+  if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode) || st->st_size == 0) {
+    close(fd);
+    return -1;
   }
-
-  close(fd);
-  
-  return result;
+  return fd;
 }
 
 void FileService::head(HTTPRequest *request, HTTPResponse *response) {
@@ -68,3 +169,11 @@ void FileService::head(HTTPRequest *request, HTTPResponse *response) {
   this->get(request, response);
   response->setBody("");
 }
+
+long long FileService::sizeHint(string path) {
+  struct stat st;
+  if (stat((this->m_basedir + path).c_str(), &st) != 0) {
+    return -1;
+  }
+  return st.st_size;
+}
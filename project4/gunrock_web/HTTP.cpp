@@ -127,10 +127,23 @@ int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 int HTTP::message_complete_cb(http_parser *parser)
 {
     HTTP *http = (HTTP *) parser->data;
-    assert((http->getState() == HTTP::VALUE) || 
+    // HEADER when the request had no header lines at all
+    assert((http->getState() == HTTP::HEADER) ||
+           (http->getState() == HTTP::VALUE) ||
            (http->getState() == HTTP::BODY));
     http->setState(HTTP::DONE);
     http->messageComplete(parser->method);
+
+    if(http->m_httpType == HTTP_REQUEST) {
+        http->m_keepAlive = http_should_keep_alive(parser);
+        http->m_acceptsChunked = parser->http_major > 1 ||
+                                 (parser->http_major == 1 && parser->http_minor >= 1);
+        // Stop at the end of the request so addData doesn't consume
+        // whatever the client sent after it. The parser reports one
+        // byte short when a callback stops it.
+        http->m_extraParsedBytes = 1;
+        return -1;
+    }
     return 0;
 }
 
@@ -148,6 +161,8 @@ HTTP::HTTP(http_parser_type httpType)
     m_doneParsing = false;
     m_httpType = httpType;
     m_headerDone = false;
+    m_keepAlive = false;
+    m_acceptsChunked = false;
 
     m_settings.on_message_begin = message_begin_cb;
     m_settings.on_path = path_cb;
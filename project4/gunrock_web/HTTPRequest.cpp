@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <strings.h>
 
 #include "HttpUtils.h"
 #include "StringUtils.h"
@@ -52,8 +53,8 @@ string HTTPRequest::getHeader(string key) {
   vector<pair<string *, string *> >::iterator iter;
   vector<pair<string *, string *> > headers = m_http->getHeaders();
   for (iter = headers.begin(); iter != headers.end(); iter++) {
-    string header_key = *(iter->first);
-    if (header_key == key) {
+    // header names are case-insensitive
+    if (strcasecmp(iter->first->c_str(), key.c_str()) == 0) {
       return *(iter->second);
     }
   }
@@ -61,6 +62,15 @@ string HTTPRequest::getHeader(string key) {
   throw "could not find header";
 }
 
+bool HTTPRequest::hasHeader(string key) {
+  try {
+    getHeader(key);
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
 bool HTTPRequest::hasAuthToken() {
   try {
     getHeader("x-auth-token");
@@ -95,6 +105,18 @@ bool HTTPRequest::readRequest()
     return true;
 }
 
+int HTTPRequest::addData(const char *buffer, unsigned int len)
+{
+    assert(!m_http->isDone());
+
+    int ret = m_http->addData((const unsigned char *) buffer, len);
+    if(ret <= 0 || (!m_http->isDone() && (unsigned int) ret < len)) {
+        return -1;
+    }
+    m_totalBytesRead += ret;
+    return ret;
+}
+
 void HTTPRequest::onRead(const char *buffer, unsigned int len)
 {
     m_totalBytesRead += len;
@@ -1,28 +1,84 @@
 #include <sstream>
 
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
 #include "HTTPResponse.h"
 
 using namespace std;
 
 HTTPResponse::HTTPResponse() {
   this->streaming = false;
+  this->sentHeaders = false;
+  this->client = NULL;
   this->contentType = "text/html; charset=ISO-8859-1";
   this->headers["Server"] = "Gunrock Web";
   this->status = 200;
+  this->bodyFd = -1;
+  this->bodyFileOffset = 0;
+  this->bodyFileLength = 0;
+}
+
+HTTPResponse::~HTTPResponse() {
+  setBodyFile(-1, 0, 0);
 }
 
 void HTTPResponse::withStreaming() {
   this->streaming = true;
 }
 
+void HTTPResponse::writeChunk(const void *data, size_t length) {
+  if (length == 0) {
+    // a zero-length chunk would end the body
+    return;
+  }
+  // headers (the first time), chunk size, data and CRLF in one writev
+  string head = sentHeaders ? "" : response();
+  char size[32];
+  int sizeLength = snprintf(size, sizeof(size), "%zx\r\n", length);
+  struct iovec iov[4];
+  int count = 0;
+  if (!head.empty()) {
+    iov[count].iov_base = (void *) head.data();
+    iov[count++].iov_len = head.size();
+  }
+  iov[count].iov_base = size;
+  iov[count++].iov_len = sizeLength;
+  iov[count].iov_base = (void *) data;
+  iov[count++].iov_len = length;
+  iov[count].iov_base = (void *) "\r\n";
+  iov[count++].iov_len = 2;
+  sentHeaders = true;
+  client->writev(iov, count);
+}
+
+void HTTPResponse::endStream() {
+  string out = sentHeaders ? "" : response();
+  out += "0\r\n\r\n";
+  sentHeaders = true;
+  client->write(out);
+}
+
 void HTTPResponse::setHeader(string name, string value) {
   this->headers[name] = value;
 }
 
 void HTTPResponse::setBody(string data) {
+  setBodyFile(-1, 0, 0);
   body = data;
 }
 
+void HTTPResponse::setBodyFile(int fd, long long offset, long long length) {
+  if (bodyFd >= 0) {
+    close(bodyFd);
+  }
+  body = "";
+  bodyFd = fd;
+  bodyFileOffset = offset;
+  bodyFileLength = length;
+}
+
 int HTTPResponse::getStatus() {
   return status;
 }
@@ -36,22 +92,43 @@ void HTTPResponse::setStatus(int status) {
 }
 
 string HTTPResponse::statusToString() {
-  if (status == 200) {
-    return "OK";
-  } else {
-    return "Unknown";
+  switch (status) {
+  case 200: return "OK";
+  case 206: return "Partial Content";
+  case 304: return "Not Modified";
+  case 400: return "Bad Request";
+  case 401: return "Unauthorized";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 409: return "Conflict";
+  case 416: return "Range Not Satisfiable";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  case 503: return "Service Unavailable";
+  case 507: return "Insufficient Storage";
+  default: return "Unknown";
   }
 }
 
+void HTTPResponse::setEntityHeaders(const string &lines) {
+  this->entityHeaders = lines;
+}
+
 string HTTPResponse::response() {
   stringstream out;
-  setHeader("Content-Type", contentType);
-  if (streaming) {
-    setHeader("Transfer-Encoding", "chunked");
-  } else {
-    stringstream len;
-    len << body.size();
-    setHeader("Content-Length", len.str());
+  if (entityHeaders.empty()) {
+    setHeader("Content-Type", contentType);
+    if (streaming) {
+      setHeader("Transfer-Encoding", "chunked");
+    } else if (status == 304) {
+      // a 304 has no body, and a Content-Length would describe the one
+      // the client already has
+    } else {
+      stringstream len;
+      len << (bodyFd >= 0 ? bodyFileLength : (long long) body.size());
+      setHeader("Content-Length", len.str());
+    }
   }
 
   out << "HTTP/1.1 " << status << " " << statusToString() << "\r\n";
@@ -59,7 +136,7 @@ string HTTPResponse::response() {
   for(iter = headers.begin(); iter != headers.end(); iter++) {
     out << iter->first << ": " << iter->second << "\r\n";
   }
-  out << "\r\n";
+  out << entityHeaders << "\r\n";
   if (body.size() > 0 && !streaming) {
     out << body;
   }
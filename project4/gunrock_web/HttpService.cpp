@@ -1,9 +1,11 @@
+#include <atomic>
 #include <iostream>
 
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "HttpService.h"
+#include "HttpUtils.h"
 #include "ClientError.h"
 
 using namespace std;
@@ -41,8 +43,96 @@ void HttpService::del(HTTPRequest *request, HTTPResponse *response) {
   throw ClientError::methodNotAllowed();
 }
 
+long long HttpService::sizeHint(string path) {
+  return -1;
+}
+
 void HttpService::move(HTTPRequest *request, HTTPResponse *response) {
   cout << "MOVE " << request->getPath() << endl;
   throw ClientError::methodNotAllowed();
 }
 
+
+bool HttpService::notModified(HTTPRequest *request, HTTPResponse *response, string etag, time_t lastModified) {
+  response->setHeader("ETag", etag);
+  if (lastModified >= 0) {
+    response->setHeader("Last-Modified", HttpUtils::httpDate(lastModified));
+  }
+
+  bool current = false;
+  try {
+    current = HttpUtils::etagMatches(request->getHeader("If-None-Match"), etag);
+  } catch (...) {
+    // no If-None-Match, so If-Modified-Since decides
+    try {
+      time_t since = HttpUtils::parseHttpDate(request->getHeader("If-Modified-Since"));
+      current = lastModified >= 0 && since >= 0 && lastModified <= since;
+    } catch (...) {
+    }
+  }
+
+  if (current) {
+    response->setStatus(304);
+    response->setBody("");
+  }
+  return current;
+}
+
+vector<ByteRange> HttpService::requestedRanges(HTTPRequest *request, HTTPResponse *response, long long size,
+                                               string etag, time_t lastModified) {
+  response->setHeader("Accept-Ranges", "bytes");
+  vector<ByteRange> ranges;
+  string header;
+  try {
+    header = request->getHeader("Range");
+  } catch (...) {
+    return ranges;
+  }
+
+  // If-Range means "only if it's still the version I have", compared strongly
+  try {
+    string ifRange = request->getHeader("If-Range");
+    bool current = ifRange.size() > 0 && ifRange[0] == '"'
+                       ? ifRange == etag
+                       : lastModified >= 0 && HttpUtils::parseHttpDate(ifRange) == lastModified;
+    if (!current) {
+      return ranges;
+    }
+  } catch (...) {
+  }
+
+  if (HttpUtils::parseRanges(header, size, &ranges) < 0) {
+    response->setHeader("Content-Range", "bytes */" + to_string(size));
+    throw ClientError::rangeNotSatisfiable();
+  }
+  return ranges;
+}
+
+void HttpService::setPartialBody(HTTPResponse *response, const vector<ByteRange> &ranges, long long size,
+                                 function<string(long long, long long)> read) {
+  response->setStatus(206);
+  if (ranges.size() == 1) {
+    response->setHeader("Content-Range", "bytes " + to_string(ranges[0].first) + "-" +
+                                             to_string(ranges[0].last) + "/" + to_string(size));
+    response->setBody(read(ranges[0].first, ranges[0].last - ranges[0].first + 1));
+    return;
+  }
+
+  // like nginx, a counter: it only has to be unlikely to appear in the parts
+  static atomic<unsigned long long> boundaries(0);
+  char text[32];
+  snprintf(text, sizeof(text), "%020llu", ++boundaries);
+  string boundary = text;
+  string contentType = response->getContentType();
+  string body;
+  for (size_t idx = 0; idx < ranges.size(); idx++) {
+    body += "\r\n--" + boundary + "\r\n";
+    body += "Content-Type: " + contentType + "\r\n";
+    body += "Content-Range: bytes " + to_string(ranges[idx].first) + "-" + to_string(ranges[idx].last) + "/" +
+            to_string(size) + "\r\n\r\n";
+    body += read(ranges[idx].first, ranges[idx].last - ranges[idx].first + 1);
+  }
+  body += "\r\n--" + boundary + "--\r\n";
+  response->setContentType("multipart/byteranges; boundary=" + boundary);
+  response->setBody(body);
+}
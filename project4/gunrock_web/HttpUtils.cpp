@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "HttpUtils.h"
 
@@ -29,13 +31,19 @@ map<string, string> HttpUtils::params(string query) {
 void HttpUtils::writeChunk(MySocket *client,
 				      const void *buf, int numBytes) {
 
-  char chunkHeader[256];
-  snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", numBytes);
-  client->write(chunkHeader);
+  char chunkHeader[32];
+  int headerLength = snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", numBytes);
+  struct iovec iov[3];
+  int count = 0;
+  iov[count].iov_base = chunkHeader;
+  iov[count++].iov_len = headerLength;
   if (buf != NULL && numBytes > 0) {
-    client->write(string((const char *) buf, numBytes));
+    iov[count].iov_base = (void *) buf;
+    iov[count++].iov_len = numBytes;
   }
-  client->write("\r\n");
+  iov[count].iov_base = (void *) "\r\n";
+  iov[count++].iov_len = 2;
+  client->writev(iov, count);
 }
 
 void HttpUtils::writeLastChunk(MySocket *client) {
@@ -69,3 +77,104 @@ vector<string> HttpUtils::split(const string &s, char delim) {
   }
   return result;
 }
+
+string HttpUtils::httpDate(time_t when) {
+  struct tm tm;
+  char text[64];
+  gmtime_r(&when, &tm);
+  strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return text;
+}
+
+time_t HttpUtils::parseHttpDate(string date) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    return -1;
+  }
+  return timegm(&tm);
+}
+
+bool HttpUtils::etagMatches(string ifNoneMatch, string etag) {
+  // If-None-Match compares weakly: W/"x" matches "x"
+  if (etag.compare(0, 2, "W/") == 0) {
+    etag = etag.substr(2);
+  }
+  vector<string> tags = split(ifNoneMatch, ',');
+  for (unsigned idx = 0; idx < tags.size(); idx++) {
+    string tag = tags[idx];
+    size_t start = tag.find_first_not_of(" \t");
+    size_t end = tag.find_last_not_of(" \t");
+    if (start == string::npos) {
+      continue;
+    }
+    tag = tag.substr(start, end - start + 1);
+    if (tag.compare(0, 2, "W/") == 0) {
+      tag = tag.substr(2);
+    }
+    if (tag == "*" || tag == etag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// more than this and the header is ignored: each range costs a part
+#define MAX_RANGES (16)
+
+int HttpUtils::parseRanges(string header, long long size, vector<ByteRange> *ranges) {
+  ranges->clear();
+  if (header.compare(0, 6, "bytes=") != 0) {
+    return 0;
+  }
+  vector<string> specs = split(header.substr(6), ',');
+  if (specs.empty() || specs.size() > MAX_RANGES) {
+    return 0;
+  }
+
+  for (unsigned idx = 0; idx < specs.size(); idx++) {
+    string spec = specs[idx];
+    size_t start = spec.find_first_not_of(" \t");
+    size_t end = spec.find_last_not_of(" \t");
+    if (start == string::npos) {
+      return 0;
+    }
+    spec = spec.substr(start, end - start + 1);
+    size_t dash = spec.find('-');
+    if (dash == string::npos || spec.find_first_not_of("0123456789-") != string::npos ||
+        spec.find('-', dash + 1) != string::npos) {
+      return 0;
+    }
+    string from = spec.substr(0, dash);
+    string to = spec.substr(dash + 1);
+
+    ByteRange range;
+    if (from.empty()) {
+      // "-n" is the last n bytes
+      if (to.empty()) {
+        return 0;
+      }
+      long long suffix = strtoll(to.c_str(), NULL, 10);
+      if (suffix == 0 || size == 0) {
+        continue;
+      }
+      range.first = suffix >= size ? 0 : size - suffix;
+      range.last = size - 1;
+    } else {
+      range.first = strtoll(from.c_str(), NULL, 10);
+      range.last = to.empty() ? range.first : strtoll(to.c_str(), NULL, 10);
+      if (range.last < range.first) {
+        return 0;
+      }
+      if (range.first >= size) {
+        continue;
+      }
+      if (to.empty() || range.last >= size) {
+        range.last = size - 1;
+      }
+    }
+    ranges->push_back(range);
+  }
+  return ranges->empty() ? -1 : 1;
+}
@@ -4,13 +4,22 @@
 #include <assert.h>
 #include <cstring>
 #include <algorithm>
+#include <climits>
+#include <unordered_map>
 #include <stdlib.h>
+#include <time.h>
 
 #include "LocalFileSystem.h"
+#include "BlockCompressor.h"
 #include "ufs.h"
 
 using namespace std;
 
+// readahead window bounds, in blocks
+#define READAHEAD_MIN (2)
+#define READAHEAD_INITIAL (4)
+#define READAHEAD_MAX (DIRECT_PTRS)
+
 /*
 read(), write(), seek()
 
@@ -40,6 +49,33 @@ for debugging: gdbserver localhost:1234 ./ds3mkdir tests/disk_images/a.img 0 hi.
 
 LocalFileSystem::LocalFileSystem(Disk *disk) {
   this->disk = disk;
+  this->snapshotBase = -1;
+  this->batching = false;
+  this->streamInode = -1;
+  this->streamError = 0;
+  this->fingerprintIndexLoaded = false;
+  memset(batchRegions, 0, sizeof(batchRegions));
+}
+
+void LocalFileSystem::readRegion(int region, int addr, int len, void *buffer) {
+  if (batching) {
+    memcpy(buffer, batchRegions[region].data, (size_t) len * UFS_BLOCK_SIZE);
+    return;
+  }
+  for (int i = 0; i < len; i++) {
+    disk->readBlock(addr + i, (char *) buffer + (size_t) i * UFS_BLOCK_SIZE);
+  }
+}
+
+void LocalFileSystem::writeRegion(int region, int addr, int len, const void *buffer) {
+  if (batching) {
+    memcpy(batchRegions[region].data, buffer, (size_t) len * UFS_BLOCK_SIZE);
+    batchRegions[region].dirty = true;
+    return;
+  }
+  for (int i = 0; i < len; i++) {
+    disk->writeBlock(addr + i, (char *) buffer + (size_t) i * UFS_BLOCK_SIZE);
+  }
 }
 
 void LocalFileSystem::readSuperBlock(super_t *super) {
@@ -49,43 +85,234 @@ void LocalFileSystem::readSuperBlock(super_t *super) {
   delete[] buffer;
 }
 
+// A snapshot view reads metadata from the copies in its slot, which are
+// laid out in the same order as the live regions after a header block.
 void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
-  for (int i = 0; i < super->inode_bitmap_len; i++) {
-    disk->readBlock(super->inode_bitmap_addr + i, inodeBitmap + i * UFS_BLOCK_SIZE);
+  int addr = super->inode_bitmap_addr;
+  if (snapshotBase >= 0) {
+    addr = snapshotBase + 1;
   }
+  readRegion(REGION_INODE_BITMAP, addr, super->inode_bitmap_len, inodeBitmap);
 }
 
 void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
-  for (int i = 0; i < super->data_bitmap_len; i++) {
-    disk->readBlock(super->data_bitmap_addr + i, dataBitmap + i * UFS_BLOCK_SIZE);
+  int addr = super->data_bitmap_addr;
+  if (snapshotBase >= 0) {
+    addr = snapshotBase + 1 + super->inode_bitmap_len;
   }
+  readRegion(REGION_DATA_BITMAP, addr, super->data_bitmap_len, dataBitmap);
 }
 
 void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
-  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-  for (int i = 0; i < super->inode_region_len; i++) {
-    disk->readBlock(super->inode_region_addr + i, inodes + i * inodesPerBlock);
+  int addr = super->inode_region_addr;
+  if (snapshotBase >= 0) {
+    addr = snapshotBase + 1 + super->inode_bitmap_len + super->data_bitmap_len;
   }
+  readRegion(REGION_INODES, addr, super->inode_region_len, inodes);
 }
 
 
 void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
-  for (int i = 0; i < super->inode_bitmap_len; i++) {
-    disk->writeBlock(super->inode_bitmap_addr + i, inodeBitmap + (i * UFS_BLOCK_SIZE));
-  }
+  writeRegion(REGION_INODE_BITMAP, super->inode_bitmap_addr, super->inode_bitmap_len, inodeBitmap);
 }
 
 void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap) {
-  for (int i = 0; i < super->data_bitmap_len; i++) {
-    disk->writeBlock(super->data_bitmap_addr + i, dataBitmap + (i * UFS_BLOCK_SIZE));
-  }
+  writeRegion(REGION_DATA_BITMAP, super->data_bitmap_addr, super->data_bitmap_len, dataBitmap);
 }
 
 void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
-  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-  for (int i = 0; i < super->inode_region_len; i++) {
-    disk->writeBlock(super->inode_region_addr + i, inodes + (i * inodesPerBlock));
+  writeRegion(REGION_INODES, super->inode_region_addr, super->inode_region_len, inodes);
+}
+
+void LocalFileSystem::readSuperExtension(super_ext_t *ext) {
+  char *buffer = new char[UFS_BLOCK_SIZE];
+  disk->readBlock(0, buffer);
+  memcpy(ext, buffer + UFS_SUPER_EXT_OFFSET, sizeof(super_ext_t));
+  delete[] buffer;
+
+  if (ext->magic != UFS_EXT_MAGIC) {
+    memset(ext, 0, sizeof(super_ext_t));
+  }
+}
+
+void LocalFileSystem::readRefcountRegion(super_ext_t *ext, unsigned int *refcounts) {
+  readRegion(REGION_REFCOUNTS, ext->refcount_addr, ext->refcount_len, refcounts);
+}
+
+void LocalFileSystem::writeRefcountRegion(super_ext_t *ext, unsigned int *refcounts) {
+  writeRegion(REGION_REFCOUNTS, ext->refcount_addr, ext->refcount_len, refcounts);
+}
+
+void LocalFileSystem::readFingerprintRegion(super_ext_t *ext, unsigned long long *fingerprints) {
+  readRegion(REGION_FINGERPRINTS, ext->fingerprint_addr, ext->fingerprint_len, fingerprints);
+}
+
+void LocalFileSystem::writeFingerprintRegion(super_ext_t *ext, unsigned long long *fingerprints) {
+  writeRegion(REGION_FINGERPRINTS, ext->fingerprint_addr, ext->fingerprint_len, fingerprints);
+}
+
+// 64-bit FNV-1a over a whole block. Zero is reserved for "no fingerprint"
+// (directory blocks, free blocks), so the low bit is always set.
+static unsigned long long fingerprintBlock(const char *block) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (int i = 0; i < UFS_BLOCK_SIZE; i++) {
+    hash ^= (unsigned char) block[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash | 1;
+}
+
+void LocalFileSystem::readInodeExtRegion(super_ext_t *ext, inode_ext_t *inodeExts) {
+  // the inode ext copy is the last thing in a snapshot slot
+  int addr = ext->inode_ext_addr;
+  if (snapshotBase >= 0) {
+    addr = snapshotBase + ext->snapshot_len - ext->inode_ext_len;
+  }
+  readRegion(REGION_INODE_EXTS, addr, ext->inode_ext_len, inodeExts);
+}
+
+void LocalFileSystem::writeInodeExtRegion(super_ext_t *ext, inode_ext_t *inodeExts) {
+  writeRegion(REGION_INODE_EXTS, ext->inode_ext_addr, ext->inode_ext_len, inodeExts);
+}
+
+// Drop one reference to a data block and free it once nobody uses it.
+// Without refcounts (no dedup or snapshots) every block has exactly one
+// owner, and fingerprints are only kept with dedup.
+static void releaseDataBlock(int relativeBlockNumber, unsigned char *dataBitMap,
+                             unsigned int *refcounts, unsigned long long *fingerprints) {
+  if (refcounts != NULL && refcounts[relativeBlockNumber] > 1) {
+    refcounts[relativeBlockNumber]--;
+    return;
+  }
+  if (refcounts != NULL) {
+    refcounts[relativeBlockNumber] = 0;
+  }
+  if (fingerprints != NULL) {
+    fingerprints[relativeBlockNumber] = 0;
+  }
+  dataBitMap[relativeBlockNumber / 8] &= ~(1 << (relativeBlockNumber % 8));
+}
+
+// Number of direct[] blocks holding an inode's data.
+static int storedBlockCount(inode_t *inode, inode_ext_t *inodeExt) {
+  int storedSize = inode->size;
+  if (inodeExt != NULL && (inodeExt->flags & UFS_INODE_COMPRESSED)) {
+    storedSize = inodeExt->stored_size;
+  }
+  return (storedSize + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+}
+
+// Lay out file data as a compressed stream (see compressed_header_t).
+// Stops at a frame boundary before the stream grows past `capacity` bytes
+// and returns how many bytes of file data the stream covers.
+static int buildCompressedStream(const char *data, int size, int capacity, string *stream) {
+  stream->clear();
+  if (size == 0) {
+    return 0;
+  }
+
+  compressed_header_t header;
+  memset(&header, 0, sizeof(header));
+  stream->assign(sizeof(header), '\0');
+
+  char frame[UFS_BLOCK_SIZE];
+  int covered = 0;
+  for (int f = 0; f < DIRECT_PTRS && covered < size; f++) {
+    int length = std::min(UFS_BLOCK_SIZE, size - covered);
+    // only keep the compressed form when it actually saves space
+    int compressedLength = BlockCompressor::compress(data + covered, length, frame, length - 1);
+    int encodedLength = 1 + (compressedLength > 0 ? compressedLength : length);
+    if ((int) stream->size() + encodedLength > capacity) {
+      break;
+    }
+
+    if (compressedLength > 0) {
+      stream->push_back((char) UFS_FRAME_LZ4);
+      stream->append(frame, compressedLength);
+    } else {
+      stream->push_back((char) UFS_FRAME_RAW);
+      stream->append(data + covered, length);
+    }
+    header.frame_end[f] = stream->size();
+    header.frame_count = f + 1;
+    covered += length;
+  }
+
+  if (header.frame_count == 0) {
+    stream->clear();
+    return 0;
+  }
+  memcpy(&(*stream)[0], &header, sizeof(header));
+  return covered;
+}
+
+int LocalFileSystem::readCompressed(inode_t *inode, void *buffer, int offset, int size) {
+  if (size <= 0) {
+    return 0;
+  }
+
+  char block[UFS_BLOCK_SIZE];
+  disk->readBlock(inode->direct[0], block);
+  compressed_header_t header;
+  memcpy(&header, block, sizeof(header));
+
+  // only decode the frames covering [offset, offset + size)
+  int firstFrame = offset / UFS_BLOCK_SIZE;
+  int lastFrame = (offset + size - 1) / UFS_BLOCK_SIZE;
+  if (header.frame_count < 0 || header.frame_count > DIRECT_PTRS || lastFrame >= header.frame_count) {
+    return -EINVALIDINODE;
+  }
+  // the frame table comes off the disk, so make sure every frame we touch
+  // lies inside the stream before trusting it
+  int previousEnd = sizeof(compressed_header_t);
+  for (int f = 0; f <= lastFrame; f++) {
+    if (header.frame_end[f] <= previousEnd || header.frame_end[f] > DIRECT_PTRS * UFS_BLOCK_SIZE) {
+      return -EINVALIDINODE;
+    }
+    previousEnd = header.frame_end[f];
   }
+  int streamStart = firstFrame == 0 ? sizeof(compressed_header_t) : header.frame_end[firstFrame - 1];
+  int streamEnd = header.frame_end[lastFrame];
+  int firstBlock = streamStart / UFS_BLOCK_SIZE;
+  int blocksNeeded = (streamEnd + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+
+  char *stream = new char[blocksNeeded * UFS_BLOCK_SIZE];
+  memcpy(stream, block, UFS_BLOCK_SIZE);
+  // the frame table says exactly which blocks we need, so ask for all of them
+  int issuedUpTo = firstBlock + 1;
+  readAhead(inode, firstBlock, blocksNeeded, blocksNeeded, &issuedUpTo);
+  for (int i = std::max(firstBlock, 1); i < blocksNeeded; i++) {
+    disk->readBlock(inode->direct[i], stream + i * UFS_BLOCK_SIZE);
+  }
+
+  char frame[UFS_BLOCK_SIZE];
+  int frameStart = streamStart;
+  int bytesRead = 0;
+  for (int f = firstFrame; f <= lastFrame; f++) {
+    int frameLength = header.frame_end[f] - frameStart;
+    int expected = std::min(UFS_BLOCK_SIZE, inode->size - f * UFS_BLOCK_SIZE);
+    int decoded;
+    if (stream[frameStart] == UFS_FRAME_RAW) {
+      decoded = std::min(frameLength - 1, UFS_BLOCK_SIZE);
+      memcpy(frame, stream + frameStart + 1, decoded);
+    } else {
+      decoded = BlockCompressor::decompress(stream + frameStart + 1, frameLength - 1, frame, UFS_BLOCK_SIZE);
+    }
+    if (decoded != expected) {
+      delete[] stream;
+      return -EINVALIDINODE;
+    }
+
+    // the first frame may start before `offset`
+    int frameOffset = f == firstFrame ? offset - f * UFS_BLOCK_SIZE : 0;
+    int bytesToCopy = std::min(decoded - frameOffset, size - bytesRead);
+    memcpy((char *)buffer + bytesRead, frame + frameOffset, bytesToCopy);
+    bytesRead += bytesToCopy;
+    frameStart = header.frame_end[f];
+  }
+
+  delete[] stream;
+  return bytesRead;
 }
 
 /**
@@ -166,7 +393,7 @@ int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
     return -EINVALIDINODE;
   }
 
-  inode_t *inodes = new inode_t[super.num_inodes];
+  inode_t *inodes = new inode_t[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
   readInodeRegion(&super, inodes);
 
   *inode = inodes[inodeNumber];
@@ -189,6 +416,10 @@ int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
    * Failure modes: invalid inodeNumber, invalid size.
    */
 int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
+  return readAt(inodeNumber, buffer, 0, size);
+}
+
+int LocalFileSystem::readAt(int inodeNumber, void *buffer, int offset, int size) {
   super_t super;
   readSuperBlock(&super);
 
@@ -196,35 +427,111 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
   if (stat(inodeNumber, &inode) < 0) {
     return -EINVALIDINODE;
   }
+  if (offset < 0) {
+    return -EINVALIDSIZE;
+  }
+  if (offset >= inode.size) {
+    return 0;
+  }
+
+  if (size <= 0 || size > inode.size - offset) {
+    size = inode.size - offset;
+  }
 
-  if (size <= 0 || size > inode.size) {
-    size = inode.size;
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  if (ext.features & UFS_FEATURE_COMPRESSION) {
+    inode_ext_t *inodeExts = new inode_ext_t[ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+    readInodeExtRegion(&ext, inodeExts);
+    bool compressed = (inodeExts[inodeNumber].flags & UFS_INODE_COMPRESSED) != 0;
+    delete[] inodeExts;
+    if (compressed) {
+      return readCompressed(&inode, buffer, offset, size);
+    }
   }
 
   int bytesRead = 0;
-  int blockIndex = 0;
-  int posInBytes = 0;
+  int firstBlock = offset / UFS_BLOCK_SIZE;
+  int blockIndex = firstBlock;
+  int posInBytes = offset;
 
   int blockUsed = (inode.size + 4095) / 4096;
 
+  // reads walk direct[] in order from the first block they need, so any
+  // read that spans more than one block is sequential and worth reading
+  // ahead for. One that starts where the last read of this inode ended (a
+  // file sent in chunks) continues that scan: its window may run on past
+  // this call towards the end of the file, and what was already issued
+  // isn't asked for again.
+  ReadaheadState state = {READAHEAD_INITIAL, -1, 0};
+  unordered_map<int, ReadaheadState>::iterator saved = readaheads.find(inodeNumber);
+  if (saved != readaheads.end()) {
+    state = saved->second;
+  }
+  bool continuing = offset == state.nextOffset;
+  int blocksWanted = std::min(blockUsed, (offset + size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+  int issuedUpTo = firstBlock + 1;
+  if (continuing) {
+    blocksWanted = blockUsed;
+    issuedUpTo = std::max(issuedUpTo, state.issuedUpTo);
+  }
+  int window = state.window;
+  int hits = 0;
+  int misses = 0;
+
   while (bytesRead < size && blockIndex < blockUsed) {
+    if ((blockIndex > firstBlock || continuing) && blockIndex < issuedUpTo) {
+      if (disk->isCached(inode.direct[blockIndex])) {
+        hits++;
+      } else {
+        misses++;
+      }
+    }
+    readAhead(&inode, blockIndex, blocksWanted, window, &issuedUpTo);
 
     char blockData[UFS_BLOCK_SIZE];
     disk->readBlock(inode.direct[blockIndex], blockData);
 
-    int offset = posInBytes % UFS_BLOCK_SIZE;
-    int bytesToCopy = std::min(UFS_BLOCK_SIZE - offset, size - bytesRead);
+    int blockOffset = posInBytes % UFS_BLOCK_SIZE;
+    int bytesToCopy = std::min(UFS_BLOCK_SIZE - blockOffset, size - bytesRead);
 
-    memcpy((char *)buffer + bytesRead, blockData + offset, bytesToCopy);
+    memcpy((char *)buffer + bytesRead, blockData + blockOffset, bytesToCopy);
 
     bytesRead += bytesToCopy;
     posInBytes += bytesToCopy;
     blockIndex++;
   }
 
+  // prefetched blocks that were evicted before we got to them mean the
+  // window is running too far ahead
+  if (hits > 0 && misses == 0) {
+    window = std::min(window * 2, READAHEAD_MAX);
+  } else if (misses > hits) {
+    window = std::max(window / 2, READAHEAD_MIN);
+  }
+  if (continuing || blocksWanted - firstBlock > 1) {
+    state.window = window;
+    state.nextOffset = offset + bytesRead;
+    state.issuedUpTo = issuedUpTo;
+    readaheads[inodeNumber] = state;
+  }
+
   return bytesRead;
 }
 
+void LocalFileSystem::readAhead(inode_t *inode, int blockIndex, int blocks, int window, int *issuedUpTo) {
+  // top the window up once half of it has been consumed
+  int end = std::min(blocks, blockIndex + 1 + window);
+  if (*issuedUpTo - (blockIndex + 1) <= window / 2 && *issuedUpTo < end) {
+    vector<int> prefetch;
+    for (int i = std::max(*issuedUpTo, blockIndex + 1); i < end; i++) {
+      prefetch.push_back(inode->direct[i]);
+    }
+    disk->prefetch(prefetch);
+    *issuedUpTo = end;
+  }
+}
+
 /**
    * Makes a file or directory.
    *
@@ -244,6 +551,10 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
    * return an error.
    */
 int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
   super_t super;
   readSuperBlock(&super);
 
@@ -322,7 +633,7 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
   // inodeBitMap[newInodeNumber / 8] |= (1 << (newInodeNumber % 8));
   // dataBitMap[newBlockNumber / 8] |= (1 << (newBlockNumber % 8));
 
-  inode_t *inodes = new inode_t[super.num_inodes];
+  inode_t *inodes = new inode_t[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
   readInodeRegion(&super, inodes);
 
   inode_t &newInode = inodes[newInodeNumber];
@@ -362,10 +673,31 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
 
   inodeBitMap[newInodeNumber / 8] |= (1 << (newInodeNumber % 8));
 
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  unsigned int *refcounts = NULL;
+  if (ext.refcount_len > 0) {
+    refcounts = new unsigned int[ext.refcount_len * UFS_BLOCK_SIZE / sizeof(unsigned int)];
+    readRefcountRegion(&ext, refcounts);
+  }
+
   if (newInode.type == UFS_DIRECTORY) {
     dataBitMap[newDataBlockNumber / 8] |= (1 << (newDataBlockNumber % 8));
+    if (refcounts != NULL) {
+      refcounts[newDataBlockNumber] = 1;
+    }
   }
 
+  // a snapshot may still be looking at the parent's old entries
+  int parentBlock = unshareBlock(&super, parentInode.direct[0], dataBitMap, refcounts);
+  if (parentBlock < 0) {
+    delete[] refcounts;
+    delete[] inodeBitMap;
+    delete[] dataBitMap;
+    delete[] inodes;
+    return -ENOTENOUGHSPACE;
+  }
+  parentInode.direct[0] = parentBlock;
 
   parentInode.size += sizeof(dir_ent_t);
   disk->writeBlock(parentInode.direct[0], parentDirBlock);
@@ -374,6 +706,10 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
   writeInodeRegion(&super, inodes);
   writeInodeBitmap(&super, inodeBitMap);
   writeDataBitmap(&super, dataBitMap);
+  if (refcounts != NULL) {
+    writeRefcountRegion(&ext, refcounts);
+    delete[] refcounts;
+  }
 
   // inode_t checkInode;
   // if (stat(newInodeNumber, &checkInode) < 0) {
@@ -409,6 +745,14 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
    * inode.direct
    */
 int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
+  return storeFile(inodeNumber, (const char *) buffer, size, false);
+}
+
+int LocalFileSystem::storeFile(int inodeNumber, const char *buffer, int size, bool append) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
   super_t super;
   readSuperBlock(&super);
 
@@ -425,7 +769,10 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
     return -EINVALIDTYPE;
   }
 
-  inode_t *inodes = new inode_t[super.num_inodes];
+  super_ext_t ext;
+  readSuperExtension(&ext);
+
+  inode_t *inodes = new inode_t[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
   readInodeRegion(&super, inodes);
 
   inode = inodes[inodeNumber];
@@ -433,63 +780,650 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
   int dataMapSize = UFS_BLOCK_SIZE * super.data_bitmap_len;
   unsigned char *dataBitMap = new unsigned char[dataMapSize];
   readDataBitmap(&super, dataBitMap);
-  
-  int blocksNeeded = (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-  char tempBlock[UFS_BLOCK_SIZE];
+
+  unsigned int *refcounts = NULL;
+  unsigned long long *fingerprints = NULL;
+  if (ext.refcount_len > 0) {
+    refcounts = new unsigned int[ext.refcount_len * UFS_BLOCK_SIZE / sizeof(unsigned int)];
+    readRefcountRegion(&ext, refcounts);
+  }
+  if (ext.features & UFS_FEATURE_DEDUP) {
+    fingerprints = new unsigned long long[ext.fingerprint_len * UFS_BLOCK_SIZE / sizeof(unsigned long long)];
+    readFingerprintRegion(&ext, fingerprints);
+  }
+
+  inode_ext_t *inodeExts = NULL;
+  if (ext.features & UFS_FEATURE_COMPRESSION) {
+    inodeExts = new inode_ext_t[ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+    readInodeExtRegion(&ext, inodeExts);
+  }
+  inode_ext_t *inodeExt = inodeExts != NULL ? &inodeExts[inodeNumber] : NULL;
+  bool compressed = inodeExt != NULL && (inodeExt->flags & UFS_INODE_COMPRESSED);
+
+  int oldBlockCount = storedBlockCount(&inode, inodeExt);
+  int oldSize = inode.size;
+
+  // Appends only rewrite from the block holding the current end of file:
+  // its partial tail is read back and placed in front of the new bytes.
+  // A compressed stream has to be re-encoded from the start, but it is
+  // never larger than MAX_FILE_SIZE.
+  int firstBlock = 0;
+  string combined;
+  if (append && oldSize > 0) {
+    int keep;
+    if (compressed) {
+      keep = oldSize;
+      combined.resize(keep);
+      if (readCompressed(&inode, &combined[0], 0, keep) != keep) {
+        keep = 0;
+      }
+    } else {
+      firstBlock = std::min(oldSize / UFS_BLOCK_SIZE, DIRECT_PTRS);
+      keep = oldSize - firstBlock * UFS_BLOCK_SIZE;
+      combined.resize(UFS_BLOCK_SIZE);
+      if (keep > 0) {
+        disk->readBlock(inode.direct[firstBlock], &combined[0]);
+      }
+    }
+    combined.resize(keep);
+    combined.append(buffer, size);
+    buffer = combined.data();
+    size = combined.size();
+  }
+
+  int bytesWritten;
+  if (compressed) {
+    // size the stream up front so a short write still ends on a frame
+    // boundary with a header that matches what was stored
+    int available = 0;
+    for (int j = 0; j < super.num_data; j++) {
+      if (!(dataBitMap[j / 8] & (1 << (j % 8)))) {
+        available++;
+      }
+    }
+    for (int j = 0; j < oldBlockCount; j++) {
+      int relativeBlockNumber = inode.direct[j] - super.data_region_addr;
+      if (relativeBlockNumber >= 0 && relativeBlockNumber < super.num_data &&
+          (refcounts == NULL || refcounts[relativeBlockNumber] == 1)) {
+        available++;
+      }
+    }
+    int capacity = std::min(available, DIRECT_PTRS) * UFS_BLOCK_SIZE;
+
+    string stream;
+    bytesWritten = buildCompressedStream(buffer, size, capacity, &stream);
+    inodeExt->stored_size = placeBlocks(&super, &inode, oldBlockCount, 0, stream.data(), stream.size(),
+                                        dataBitMap, refcounts, fingerprints);
+  } else {
+    bytesWritten = firstBlock * UFS_BLOCK_SIZE +
+                   placeBlocks(&super, &inode, oldBlockCount, firstBlock, buffer, size,
+                               dataBitMap, refcounts, fingerprints);
+  }
+  inode.size = bytesWritten;
+  inodes[inodeNumber] = inode;
+
+  writeInodeRegion(&super, inodes);
+  writeDataBitmap(&super, dataBitMap);
+  if (refcounts != NULL) {
+    writeRefcountRegion(&ext, refcounts);
+    delete[] refcounts;
+  }
+  if (fingerprints != NULL) {
+    writeFingerprintRegion(&ext, fingerprints);
+    delete[] fingerprints;
+  }
+  if (inodeExts != NULL) {
+    if (compressed) {
+      writeInodeExtRegion(&ext, inodeExts);
+    }
+    delete[] inodeExts;
+  }
+
+  delete[] dataBitMap;
+  delete[] inodes;
+  if (append) {
+    return std::max(bytesWritten - oldSize, 0);
+  }
+  return bytesWritten;
+}
+
+int LocalFileSystem::placeBlocks(super_t *super, inode_t *inode, int oldBlockCount, int firstBlock,
+                                 const char *data, int size, unsigned char *dataBitMap,
+                                 unsigned int *refcounts, unsigned long long *fingerprints) {
+  // Stale entries are dropped as they turn up; start over once they
+  // could outnumber live ones, which spreads the rebuild over at least
+  // num_data writes.
+  if (fingerprints != NULL &&
+      (!fingerprintIndexLoaded || (long long) fingerprintIndex.size() > 2LL * super->num_data + DIRECT_PTRS)) {
+    loadFingerprintIndex(super, refcounts, fingerprints);
+  }
+
+  int blocksNeeded = std::min(firstBlock + (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+  char newBlock[UFS_BLOCK_SIZE];
+  char existingBlock[UFS_BLOCK_SIZE];
   int bytesWritten = 0;
 
-  for (int i = 0; i < blocksNeeded && bytesWritten < size && i < DIRECT_PTRS; i++) {
-    int absoluteBlockNumber = inode.direct[i];
-    int relativeBlockNumber = absoluteBlockNumber - super.data_region_addr;
+  int i;
+  for (i = firstBlock; i < blocksNeeded; i++) {
+    int bytesToWrite = std::min(size - bytesWritten, UFS_BLOCK_SIZE);
+    // pad the tail with zeros so equal files hash equally
+    memset(newBlock, 0, UFS_BLOCK_SIZE);
+    memcpy(newBlock, data + bytesWritten, bytesToWrite);
+
+    // reuse the block already at this position when it is still ours
+    int oldBlock = -1;
+    if (i < oldBlockCount) {
+      oldBlock = inode->direct[i] - super->data_region_addr;
+      if (oldBlock < 0 || oldBlock >= super->num_data ||
+          !(dataBitMap[oldBlock / 8] & (1 << (oldBlock % 8)))) {
+        oldBlock = -1;
+      }
+    }
 
-    if (relativeBlockNumber >= 0 && relativeBlockNumber < super.data_region_len){
-      if (!(dataBitMap[relativeBlockNumber / 8] & (1 << (relativeBlockNumber % 8)))) {
-        relativeBlockNumber = -1;
+    unsigned long long fingerprint = 0;
+    int sharedBlock = -1;
+    if (fingerprints != NULL) {
+      fingerprint = fingerprintBlock(newBlock);
+      // The hash only narrows the search: a candidate is shared only after
+      // a byte-for-byte compare, so collisions can't corrupt a file.
+      auto candidates = fingerprintIndex.equal_range(fingerprint);
+      for (auto iter = candidates.first; iter != candidates.second;) {
+        int candidate = iter->second;
+        if (candidate >= super->num_data || refcounts[candidate] == 0 || fingerprints[candidate] != fingerprint) {
+          iter = fingerprintIndex.erase(iter);
+          continue;
+        }
+        disk->readBlock(super->data_region_addr + candidate, existingBlock);
+        if (memcmp(existingBlock, newBlock, UFS_BLOCK_SIZE) == 0) {
+          sharedBlock = candidate;
+          break;
+        }
+        iter++;
       }
     }
 
-    if (relativeBlockNumber < 0 || relativeBlockNumber >= super.data_region_len) { 
-      // Allocate a new block if the current direct[i] is invalid
-      bool blockAllocated = false;
-      for (int j = 0; j < super.num_data; j++) {
+    if (sharedBlock >= 0) {
+      if (sharedBlock != oldBlock) {
+        refcounts[sharedBlock]++;
+        if (oldBlock >= 0) {
+          releaseDataBlock(oldBlock, dataBitMap, refcounts, fingerprints);
+        }
+        inode->direct[i] = super->data_region_addr + sharedBlock;
+      }
+    } else if (oldBlock >= 0 && (refcounts == NULL || refcounts[oldBlock] == 1)) {
+      // we are the only owner, so overwrite in place
+      disk->writeBlock(super->data_region_addr + oldBlock, newBlock);
+      if (fingerprints != NULL) {
+        fingerprints[oldBlock] = fingerprint;
+        fingerprintIndex.insert(make_pair(fingerprint, oldBlock));
+      }
+    } else {
+      int newBlockNumber = -1;
+      for (int j = 0; j < super->num_data; j++) {
         if (!(dataBitMap[j / 8] & (1 << (j % 8)))) {
-          absoluteBlockNumber = super.data_region_addr + j;
-          inode.direct[i] = absoluteBlockNumber;
-          dataBitMap[j / 8] |= (1 << (j % 8));
-          blockAllocated = true;
+          newBlockNumber = j;
           break;
         }
       }
-      if (!blockAllocated) {
+      if (newBlockNumber == -1) {
         break;
-      }      
-    }
+      }
 
-    // dataBitMap[newDataBlockNumber / 8] |= (1 << (newDataBlockNumber % 8));
-    int bytesToWrite = std::min(size - bytesWritten, UFS_BLOCK_SIZE);
-    memcpy(tempBlock, (char *)buffer + bytesWritten, bytesToWrite);
-    disk->writeBlock(absoluteBlockNumber, tempBlock);
+      dataBitMap[newBlockNumber / 8] |= (1 << (newBlockNumber % 8));
+      if (refcounts != NULL) {
+        refcounts[newBlockNumber] = 1;
+      }
+      if (fingerprints != NULL) {
+        fingerprints[newBlockNumber] = fingerprint;
+        fingerprintIndex.insert(make_pair(fingerprint, newBlockNumber));
+      }
+      disk->writeBlock(super->data_region_addr + newBlockNumber, newBlock);
+
+      // the old block is shared with another file or a snapshot, leave it
+      // to them
+      if (oldBlock >= 0) {
+        releaseDataBlock(oldBlock, dataBitMap, refcounts, fingerprints);
+      }
+      inode->direct[i] = super->data_region_addr + newBlockNumber;
+    }
     bytesWritten += bytesToWrite;
   }
-  inode.size = bytesWritten;
-  inodes[inodeNumber] = inode;
-  // deallocate every block beyond blockUsed: update dataBitmap
 
-  int blockUsed = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-  for (int i = blockUsed; i < DIRECT_PTRS; i++) {
-    int absoluteBlockNumber = inode.direct[i];
-    int relativeBlockNumber = absoluteBlockNumber - super.data_region_addr;
-    if (relativeBlockNumber >= 0 && relativeBlockNumber < super.data_region_len) {
-      dataBitMap[relativeBlockNumber / 8] &= ~(1 << (relativeBlockNumber % 8));
+  // free the blocks this file no longer needs
+  for (int j = i; j < oldBlockCount; j++) {
+    int relativeBlockNumber = inode->direct[j] - super->data_region_addr;
+    if (relativeBlockNumber >= 0 && relativeBlockNumber < super->num_data) {
+      releaseDataBlock(relativeBlockNumber, dataBitMap, refcounts, fingerprints);
     }
   }
 
-  writeInodeRegion(&super, inodes);
+  return bytesWritten;
+}
+
+void LocalFileSystem::loadFingerprintIndex(super_t *super, unsigned int *refcounts,
+                                           unsigned long long *fingerprints) {
+  fingerprintIndex.clear();
+  fingerprintIndex.reserve(super->num_data);
+  for (int j = 0; j < super->num_data; j++) {
+    if (refcounts[j] > 0 && fingerprints[j] != 0) {
+      fingerprintIndex.insert(make_pair(fingerprints[j], j));
+    }
+  }
+  fingerprintIndexLoaded = true;
+}
+
+int LocalFileSystem::setCompressed(int inodeNumber, bool compressed) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
+  inode_t inode;
+  if (stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  if (!(ext.features & UFS_FEATURE_COMPRESSION)) {
+    return -EINVALIDTYPE;
+  }
+
+  inode_ext_t *inodeExts = new inode_ext_t[ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+  readInodeExtRegion(&ext, inodeExts);
+  bool isCompressed = (inodeExts[inodeNumber].flags & UFS_INODE_COMPRESSED) != 0;
+  if (isCompressed == compressed) {
+    delete[] inodeExts;
+    return 0;
+  }
+
+  // Empty the file in its current representation, switch, then store the
+  // contents again, so no step has to understand both layouts at once.
+  char *contents = new char[inode.size + 1];
+  int bytesRead = read(inodeNumber, contents, inode.size);
+  if (bytesRead < 0) {
+    delete[] contents;
+    delete[] inodeExts;
+    return bytesRead;
+  }
+  write(inodeNumber, contents, 0);
+
+  readInodeExtRegion(&ext, inodeExts);
+  if (compressed) {
+    inodeExts[inodeNumber].flags |= UFS_INODE_COMPRESSED;
+  } else {
+    inodeExts[inodeNumber].flags &= ~UFS_INODE_COMPRESSED;
+  }
+  inodeExts[inodeNumber].stored_size = 0;
+  writeInodeExtRegion(&ext, inodeExts);
+
+  int bytesWritten = write(inodeNumber, contents, bytesRead);
+
+  delete[] contents;
+  delete[] inodeExts;
+  if (bytesWritten < bytesRead) {
+    return -ENOTENOUGHSPACE;
+  }
+  return 0;
+}
+
+int LocalFileSystem::blockCount(int inodeNumber) {
+  inode_t inode;
+  if (stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  if (!(ext.features & UFS_FEATURE_COMPRESSION)) {
+    return storedBlockCount(&inode, NULL);
+  }
+
+  inode_ext_t *inodeExts = new inode_ext_t[ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+  readInodeExtRegion(&ext, inodeExts);
+  int blocks = storedBlockCount(&inode, &inodeExts[inodeNumber]);
+  delete[] inodeExts;
+  return blocks;
+}
+
+int LocalFileSystem::unshareBlock(super_t *super, int absoluteBlockNumber, unsigned char *dataBitMap,
+                                  unsigned int *refcounts) {
+  int relativeBlockNumber = absoluteBlockNumber - super->data_region_addr;
+  if (refcounts == NULL || relativeBlockNumber < 0 || relativeBlockNumber >= super->num_data ||
+      refcounts[relativeBlockNumber] <= 1) {
+    return absoluteBlockNumber;
+  }
+
+  int newBlockNumber = -1;
+  for (int j = 0; j < super->num_data; j++) {
+    if (!(dataBitMap[j / 8] & (1 << (j % 8)))) {
+      newBlockNumber = j;
+      break;
+    }
+  }
+  if (newBlockNumber == -1) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  // callers rewrite the whole block, so there is nothing to copy
+  dataBitMap[newBlockNumber / 8] |= (1 << (newBlockNumber % 8));
+  refcounts[newBlockNumber] = 1;
+  refcounts[relativeBlockNumber]--;
+  return super->data_region_addr + newBlockNumber;
+}
+
+int LocalFileSystem::findSnapshot(super_ext_t *ext, string name) {
+  char block[UFS_BLOCK_SIZE];
+  for (int slot = 0; slot < ext->snapshot_slots; slot++) {
+    disk->readBlock(ext->snapshot_addr + slot * ext->snapshot_len, block);
+    snapshot_t *header = (snapshot_t *) block;
+    if (header->in_use && strncmp(header->name, name.c_str(), DIR_ENT_NAME_SIZE) == 0) {
+      return slot;
+    }
+  }
+  return -ENOTFOUND;
+}
+
+int LocalFileSystem::createSnapshot(string name) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  if (!(ext.features & UFS_FEATURE_SNAPSHOT)) {
+    return -EINVALIDTYPE;
+  }
+
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE || findSnapshot(&ext, name) >= 0) {
+    return -EINVALIDNAME;
+  }
+
+  char block[UFS_BLOCK_SIZE];
+  int slot = -1;
+  for (int i = 0; i < ext.snapshot_slots; i++) {
+    disk->readBlock(ext.snapshot_addr + i * ext.snapshot_len, block);
+    if (!((snapshot_t *) block)->in_use) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == -1) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  super_t super;
+  readSuperBlock(&super);
+  int base = ext.snapshot_addr + slot * ext.snapshot_len;
+
+  // copy the metadata, in the order the read helpers expect
+  int regionAddr[] = {super.inode_bitmap_addr, super.data_bitmap_addr, super.inode_region_addr, ext.inode_ext_addr};
+  int regionLen[] = {super.inode_bitmap_len, super.data_bitmap_len, super.inode_region_len, ext.inode_ext_len};
+  int target = base + 1;
+  for (int r = 0; r < 4; r++) {
+    for (int i = 0; i < regionLen[r]; i++) {
+      disk->readBlock(regionAddr[r] + i, block);
+      disk->writeBlock(target++, block);
+    }
+  }
+
+  // the snapshot owns a reference to every block in use right now
+  int dataMapSize = UFS_BLOCK_SIZE * super.data_bitmap_len;
+  unsigned char *dataBitMap = new unsigned char[dataMapSize];
+  readDataBitmap(&super, dataBitMap);
+  unsigned int *refcounts = new unsigned int[ext.refcount_len * UFS_BLOCK_SIZE / sizeof(unsigned int)];
+  readRefcountRegion(&ext, refcounts);
+  for (int j = 0; j < super.num_data; j++) {
+    if (dataBitMap[j / 8] & (1 << (j % 8))) {
+      refcounts[j]++;
+    }
+  }
+  writeRefcountRegion(&ext, refcounts);
+
+  // the header goes last so a half-written slot still reads as free
+  memset(block, 0, UFS_BLOCK_SIZE);
+  snapshot_t *header = (snapshot_t *) block;
+  header->in_use = 1;
+  header->created = (int) time(NULL);
+  strncpy(header->name, name.c_str(), DIR_ENT_NAME_SIZE);
+  disk->writeBlock(base, block);
+
+  delete[] dataBitMap;
+  delete[] refcounts;
+  return 0;
+}
+
+int LocalFileSystem::deleteSnapshot(string name) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  int slot = findSnapshot(&ext, name);
+  if (slot < 0) {
+    return -ENOTFOUND;
+  }
+
+  super_t super;
+  readSuperBlock(&super);
+  int base = ext.snapshot_addr + slot * ext.snapshot_len;
+
+  int dataMapSize = UFS_BLOCK_SIZE * super.data_bitmap_len;
+  unsigned char *snapshotBitMap = new unsigned char[dataMapSize];
+  for (int i = 0; i < super.data_bitmap_len; i++) {
+    disk->readBlock(base + 1 + super.inode_bitmap_len + i, snapshotBitMap + i * UFS_BLOCK_SIZE);
+  }
+
+  unsigned char *dataBitMap = new unsigned char[dataMapSize];
+  readDataBitmap(&super, dataBitMap);
+  unsigned int *refcounts = new unsigned int[ext.refcount_len * UFS_BLOCK_SIZE / sizeof(unsigned int)];
+  readRefcountRegion(&ext, refcounts);
+  unsigned long long *fingerprints = NULL;
+  if (ext.features & UFS_FEATURE_DEDUP) {
+    fingerprints = new unsigned long long[ext.fingerprint_len * UFS_BLOCK_SIZE / sizeof(unsigned long long)];
+    readFingerprintRegion(&ext, fingerprints);
+  }
+
+  // drop the reference createSnapshot took on each block
+  for (int j = 0; j < super.num_data; j++) {
+    if (snapshotBitMap[j / 8] & (1 << (j % 8))) {
+      releaseDataBlock(j, dataBitMap, refcounts, fingerprints);
+    }
+  }
+
+  char block[UFS_BLOCK_SIZE];
+  memset(block, 0, UFS_BLOCK_SIZE);
+  disk->writeBlock(base, block);
+
   writeDataBitmap(&super, dataBitMap);
+  writeRefcountRegion(&ext, refcounts);
+  if (fingerprints != NULL) {
+    writeFingerprintRegion(&ext, fingerprints);
+    delete[] fingerprints;
+  }
 
+  delete[] snapshotBitMap;
   delete[] dataBitMap;
+  delete[] refcounts;
+  return 0;
+}
+
+int LocalFileSystem::listSnapshots(vector<snapshot_t> *snapshots) {
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  if (!(ext.features & UFS_FEATURE_SNAPSHOT)) {
+    return -EINVALIDTYPE;
+  }
+
+  snapshots->clear();
+  char block[UFS_BLOCK_SIZE];
+  for (int slot = 0; slot < ext.snapshot_slots; slot++) {
+    disk->readBlock(ext.snapshot_addr + slot * ext.snapshot_len, block);
+    snapshot_t *header = (snapshot_t *) block;
+    if (header->in_use) {
+      snapshots->push_back(*header);
+    }
+  }
+  return snapshots->size();
+}
+
+int LocalFileSystem::openSnapshot(string name) {
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  int slot = findSnapshot(&ext, name);
+  if (slot < 0) {
+    return -ENOTFOUND;
+  }
+
+  snapshotBase = ext.snapshot_addr + slot * ext.snapshot_len;
+  return 0;
+}
+
+// Blocks needed to hold `bytes`.
+static long long blocksFor(long long bytes) {
+  return (bytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+}
+
+// Copy `oldLen` blocks into a zeroed buffer of `newLen` blocks.
+static unsigned char *padRegion(const void *old, int oldLen, int newLen) {
+  unsigned char *grown = new unsigned char[(size_t) newLen * UFS_BLOCK_SIZE];
+  memset(grown, 0, (size_t) newLen * UFS_BLOCK_SIZE);
+  memcpy(grown, old, (size_t) oldLen * UFS_BLOCK_SIZE);
+  return grown;
+}
+
+int LocalFileSystem::grow(int numInodes, int numData) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
+  super_t super;
+  readSuperBlock(&super);
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  if (numInodes < super.num_inodes || numData < super.num_data) {
+    return -EINVALIDSIZE;
+  }
+  if (numInodes == super.num_inodes && numData == super.num_data) {
+    return 0;
+  }
+
+  // new layout: same region order as mkfs, starting right after the
+  // extended data region
+  super_t grown = super;
+  super_ext_t grownExt = ext;
+  grown.num_inodes = numInodes;
+  grown.num_data = numData;
+  grown.data_region_len = numData;
+
+  long long next = (long long) super.data_region_addr + numData;
+  long long lens[7];
+  lens[0] = blocksFor((numInodes + 7LL) / 8);
+  lens[1] = blocksFor((numData + 7LL) / 8);
+  lens[2] = blocksFor((long long) numInodes * sizeof(inode_t));
+  lens[3] = ext.refcount_len > 0 ? blocksFor((long long) numData * sizeof(unsigned int)) : 0;
+  lens[4] = ext.fingerprint_len > 0 ? blocksFor((long long) numData * sizeof(unsigned long long)) : 0;
+  lens[5] = ext.inode_ext_len > 0 ? blocksFor((long long) numInodes * sizeof(inode_ext_t)) : 0;
+  lens[6] = ext.snapshot_slots > 0 ? 1 + lens[0] + lens[1] + lens[2] + lens[5] : 0;
+  int *addrs[] = {&grown.inode_bitmap_addr, &grown.data_bitmap_addr, &grown.inode_region_addr,
+                  &grownExt.refcount_addr, &grownExt.fingerprint_addr, &grownExt.inode_ext_addr,
+                  &grownExt.snapshot_addr};
+  int *lenFields[] = {&grown.inode_bitmap_len, &grown.data_bitmap_len, &grown.inode_region_len,
+                      &grownExt.refcount_len, &grownExt.fingerprint_len, &grownExt.inode_ext_len,
+                      &grownExt.snapshot_len};
+  if (next > INT_MAX) {
+    return -ENOTENOUGHSPACE;
+  }
+  for (int r = 0; r < 7; r++) {
+    if (lens[r] == 0) {
+      continue;
+    }
+    long long size = r == 6 ? lens[r] * ext.snapshot_slots : lens[r];
+    if (next + size > INT_MAX) {
+      return -ENOTENOUGHSPACE;
+    }
+    *addrs[r] = (int) next;
+    *lenFields[r] = (int) lens[r];
+    next += size;
+  }
+
+  // read everything before writing anything, the new regions may land
+  // on top of the old ones
+  unsigned char *inodeBitmap = new unsigned char[(size_t) super.inode_bitmap_len * UFS_BLOCK_SIZE];
+  readInodeBitmap(&super, inodeBitmap);
+  unsigned char *dataBitmap = new unsigned char[(size_t) super.data_bitmap_len * UFS_BLOCK_SIZE];
+  readDataBitmap(&super, dataBitmap);
+  unsigned char *inodes = new unsigned char[(size_t) super.inode_region_len * UFS_BLOCK_SIZE];
+  readInodeRegion(&super, (inode_t *) inodes);
+  unsigned char *refcounts = new unsigned char[(size_t) ext.refcount_len * UFS_BLOCK_SIZE];
+  readRefcountRegion(&ext, (unsigned int *) refcounts);
+  unsigned char *fingerprints = new unsigned char[(size_t) ext.fingerprint_len * UFS_BLOCK_SIZE];
+  readFingerprintRegion(&ext, (unsigned long long *) fingerprints);
+  unsigned char *inodeExts = new unsigned char[(size_t) ext.inode_ext_len * UFS_BLOCK_SIZE];
+  readInodeExtRegion(&ext, (inode_ext_t *) inodeExts);
+  int snapshotBlocks = ext.snapshot_slots * ext.snapshot_len;
+  unsigned char *snapshots = new unsigned char[(size_t) snapshotBlocks * UFS_BLOCK_SIZE];
+  disk->readBlocks(ext.snapshot_addr, snapshotBlocks, snapshots);
+
+  disk->extend(next);
+
+  unsigned char *buffer = padRegion(inodeBitmap, super.inode_bitmap_len, grown.inode_bitmap_len);
+  writeInodeBitmap(&grown, buffer);
+  delete[] buffer;
+  buffer = padRegion(dataBitmap, super.data_bitmap_len, grown.data_bitmap_len);
+  writeDataBitmap(&grown, buffer);
+  delete[] buffer;
+  buffer = padRegion(inodes, super.inode_region_len, grown.inode_region_len);
+  writeInodeRegion(&grown, (inode_t *) buffer);
+  delete[] buffer;
+  buffer = padRegion(refcounts, ext.refcount_len, grownExt.refcount_len);
+  writeRefcountRegion(&grownExt, (unsigned int *) buffer);
+  delete[] buffer;
+  buffer = padRegion(fingerprints, ext.fingerprint_len, grownExt.fingerprint_len);
+  writeFingerprintRegion(&grownExt, (unsigned long long *) buffer);
+  delete[] buffer;
+  buffer = padRegion(inodeExts, ext.inode_ext_len, grownExt.inode_ext_len);
+  writeInodeExtRegion(&grownExt, (inode_ext_t *) buffer);
+  delete[] buffer;
+
+  // each snapshot slot holds a header and a copy of the four regions
+  // above, which are padded the same way
+  int oldParts[] = {1, super.inode_bitmap_len, super.data_bitmap_len, super.inode_region_len, ext.inode_ext_len};
+  int newParts[] = {1, grown.inode_bitmap_len, grown.data_bitmap_len, grown.inode_region_len, grownExt.inode_ext_len};
+  for (int slot = 0; slot < ext.snapshot_slots; slot++) {
+    unsigned char *old = snapshots + (size_t) slot * ext.snapshot_len * UFS_BLOCK_SIZE;
+    int target = grownExt.snapshot_addr + slot * grownExt.snapshot_len;
+    for (int part = 0; part < 5; part++) {
+      buffer = padRegion(old, oldParts[part], newParts[part]);
+      for (int i = 0; i < newParts[part]; i++) {
+        disk->writeBlock(target++, buffer + (size_t) i * UFS_BLOCK_SIZE);
+      }
+      delete[] buffer;
+      old += (size_t) oldParts[part] * UFS_BLOCK_SIZE;
+    }
+  }
+
+  // the super block goes last so it only ever points at complete regions
+  char block[UFS_BLOCK_SIZE];
+  disk->readBlock(0, block);
+  memcpy(block, &grown, sizeof(super_t));
+  if (ext.magic == UFS_EXT_MAGIC) {
+    memcpy(block + UFS_SUPER_EXT_OFFSET, &grownExt, sizeof(super_ext_t));
+  }
+  disk->writeBlock(0, block);
+
+  delete[] inodeBitmap;
+  delete[] dataBitmap;
   delete[] inodes;
-  return bytesWritten;
+  delete[] refcounts;
+  delete[] fingerprints;
+  delete[] inodeExts;
+  delete[] snapshots;
+  return 0;
 }
 
 /**
@@ -505,6 +1439,10 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
    * existing is NOT a failure by our definition. You can't unlink '.' or '..'
    */
 int LocalFileSystem::unlink(int parentInodeNumber, string name) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
   super_t super;
   readSuperBlock(&super);
 
@@ -580,7 +1518,7 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
 
   int inodeNumber = parentEntries[entryIdx].inum;
 
-  for (int i = entryIdx; i < totalEntries; i++) {
+  for (int i = entryIdx; i < totalEntries - 1; i++) {
     dir_ent_t temp = parentEntries[i];
     parentEntries[i] = parentEntries[i + 1];
     parentEntries[i + 1] = temp;
@@ -594,13 +1532,51 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
   unsigned char *dataBitMap = new unsigned char[dataMapSize];
   readDataBitmap(&super, dataBitMap);
 
+  // with dedup or snapshots a block may be shared, so drop a reference
+  // instead of clearing its bit outright
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  unsigned int *refcounts = NULL;
+  unsigned long long *fingerprints = NULL;
+  if (ext.refcount_len > 0) {
+    refcounts = new unsigned int[ext.refcount_len * UFS_BLOCK_SIZE / sizeof(unsigned int)];
+    readRefcountRegion(&ext, refcounts);
+  }
+  if (ext.features & UFS_FEATURE_DEDUP) {
+    fingerprints = new unsigned long long[ext.fingerprint_len * UFS_BLOCK_SIZE / sizeof(unsigned long long)];
+    readFingerprintRegion(&ext, fingerprints);
+  }
+
+  // compressed files hold fewer blocks than their size suggests
+  inode_ext_t *inodeExts = NULL;
+  if (ext.features & UFS_FEATURE_COMPRESSION) {
+    inodeExts = new inode_ext_t[ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+    readInodeExtRegion(&ext, inodeExts);
+  }
+
+  // the directory blocks we rewrite must not be ones a snapshot still sees
+  int keptDirBlocks = (parentInode.size - (int) sizeof(dir_ent_t) + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  for (int i = 0; i < keptDirBlocks; i++) {
+    int parentBlock = unshareBlock(&super, parentInode.direct[i], dataBitMap, refcounts);
+    if (parentBlock < 0) {
+      delete[] refcounts;
+      delete[] fingerprints;
+      delete[] inodeExts;
+      delete[] parentDirBuffer;
+      delete[] inodeBitMap;
+      delete[] dataBitMap;
+      return -ENOTENOUGHSPACE;
+    }
+    parentInode.direct[i] = parentBlock;
+  }
+
   if (inode.type == UFS_REGULAR_FILE) {
-    int blockCount = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int blockCount = storedBlockCount(&inode, inodeExts != NULL ? &inodeExts[inodeNumber] : NULL);
     for (int i = 0; i < blockCount; i++) {
       int absoluteBlockNumber = inode.direct[i];
       int relativeBlockNumber = absoluteBlockNumber - super.data_region_addr;
 
-      dataBitMap[relativeBlockNumber / 8] &= ~(1 << (relativeBlockNumber % 8));
+      releaseDataBlock(relativeBlockNumber, dataBitMap, refcounts, fingerprints);
     }
   } else {
     // inode.type == UFS_DIRECTORY
@@ -609,10 +1585,14 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
       int absoluteBlockNumber = inode.direct[i];
       int relativeBlockNumber = absoluteBlockNumber - super.data_region_addr;
 
-      dataBitMap[relativeBlockNumber / 8] &= ~(1 << (relativeBlockNumber % 8));
+      releaseDataBlock(relativeBlockNumber, dataBitMap, refcounts, fingerprints);
     }
   }
 
+  if (inodeExts != NULL) {
+    memset(&inodeExts[inodeNumber], 0, sizeof(inode_ext_t));
+  }
+
   inodeBitMap[inodeNumber / 8] &= ~(1 << (inodeNumber % 8));
 
 
@@ -625,7 +1605,7 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
     int absoluteBlockNumber = parentInode.direct[originalBlockCount - 1];
     int relativeBlockNumber = absoluteBlockNumber - super.data_region_addr;
 
-    dataBitMap[relativeBlockNumber / 8] &= ~(1 << (relativeBlockNumber % 8));
+    releaseDataBlock(relativeBlockNumber, dataBitMap, refcounts, fingerprints);
   }
 
   for (int i = 0; i < newBlockCount; i++) {
@@ -635,13 +1615,25 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
   // char buffer[UFS_BLOCK_SIZE];
   // disk->readBlock(parentInode.direct[0], buffer);
 
-  inode_t *inodes = new inode_t[super.num_inodes];
+  inode_t *inodes = new inode_t[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
   readInodeRegion(&super, inodes);
   inodes[parentInodeNumber] = parentInode;
   writeInodeRegion(&super, inodes);
 
   writeInodeBitmap(&super, inodeBitMap);
   writeDataBitmap(&super, dataBitMap);
+  if (refcounts != NULL) {
+    writeRefcountRegion(&ext, refcounts);
+    delete[] refcounts;
+  }
+  if (fingerprints != NULL) {
+    writeFingerprintRegion(&ext, fingerprints);
+    delete[] fingerprints;
+  }
+  if (inodeExts != NULL) {
+    writeInodeExtRegion(&ext, inodeExts);
+    delete[] inodeExts;
+  }
 
 
   delete[] parentDirBuffer;
@@ -652,3 +1644,362 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
   return 0;
 }
 
+
+int LocalFileSystem::rename(int srcParentInodeNumber, string srcName,
+                            int dstParentInodeNumber, string dstName) {
+  // a caller's transaction already covers us
+  if (disk->inTransaction()) {
+    return renameEntry(srcParentInodeNumber, srcName, dstParentInodeNumber, dstName);
+  }
+  disk->beginTransaction();
+  int ret = renameEntry(srcParentInodeNumber, srcName, dstParentInodeNumber, dstName);
+  if (ret < 0) {
+    disk->rollback();
+  } else {
+    disk->commit();
+  }
+  return ret;
+}
+
+int LocalFileSystem::renameEntry(int srcParentInodeNumber, string srcName,
+                                 int dstParentInodeNumber, string dstName) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
+  if (srcName.empty() || srcName.length() > DIR_ENT_NAME_SIZE ||
+      dstName.empty() || dstName.length() > DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
+  if (srcName == "." || srcName == ".." || dstName == "." || dstName == "..") {
+    return -EUNLINKNOTALLOWED;
+  }
+
+  super_t super;
+  readSuperBlock(&super);
+
+  inode_t srcParent;
+  inode_t dstParent;
+  if (stat(srcParentInodeNumber, &srcParent) < 0 || stat(dstParentInodeNumber, &dstParent) < 0) {
+    return -EINVALIDINODE;
+  }
+  if (srcParent.type != UFS_DIRECTORY || dstParent.type != UFS_DIRECTORY) {
+    return -EINVALIDTYPE;
+  }
+
+  int inodeNumber = lookup(srcParentInodeNumber, srcName);
+  if (inodeNumber < 0) {
+    return -ENOTFOUND;
+  }
+  inode_t inode;
+  if (stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+
+  // a directory can't end up inside itself: walk up from the destination
+  if (inode.type == UFS_DIRECTORY) {
+    int ancestor = dstParentInodeNumber;
+    for (int depth = 0; ancestor != UFS_ROOT_DIRECTORY_INODE_NUMBER; depth++) {
+      if (ancestor == inodeNumber) {
+        return -EINVALIDNAME;
+      }
+      ancestor = lookup(ancestor, "..");
+      if (ancestor < 0 || depth >= super.num_inodes) {
+        return -EINVALIDINODE;
+      }
+    }
+    if (inodeNumber == UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+      return -EINVALIDNAME;
+    }
+  }
+
+  int existingInodeNumber = lookup(dstParentInodeNumber, dstName);
+  if (existingInodeNumber == inodeNumber) {
+    return 0;
+  }
+  if (existingInodeNumber >= 0) {
+    inode_t existingInode;
+    if (stat(existingInodeNumber, &existingInode) < 0) {
+      return -EINVALIDINODE;
+    }
+    if (existingInode.type != inode.type) {
+      return -EINVALIDTYPE;
+    }
+    int ret = unlink(dstParentInodeNumber, dstName);
+    if (ret < 0) {
+      return ret;
+    }
+    // unlink rewrote the destination (and maybe the source) directory
+    stat(srcParentInodeNumber, &srcParent);
+    stat(dstParentInodeNumber, &dstParent);
+  }
+
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  int srcBlocks = (srcParent.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  char *srcBuffer = new char[srcBlocks * UFS_BLOCK_SIZE];
+  for (int i = 0; i < srcBlocks; i++) {
+    disk->readBlock(srcParent.direct[i], srcBuffer + i * UFS_BLOCK_SIZE);
+  }
+  dir_ent_t *srcEntries = (dir_ent_t *) srcBuffer;
+  int srcCount = srcParent.size / sizeof(dir_ent_t);
+  int entryIdx = -1;
+  for (int i = 0; i < srcCount; i++) {
+    if (strcmp(srcEntries[i].name, srcName.c_str()) == 0) {
+      entryIdx = i;
+      break;
+    }
+  }
+  if (entryIdx == -1) {
+    delete[] srcBuffer;
+    return -ENOTFOUND;
+  }
+
+  int dataMapSize = UFS_BLOCK_SIZE * super.data_bitmap_len;
+  unsigned char *dataBitMap = new unsigned char[dataMapSize];
+  readDataBitmap(&super, dataBitMap);
+  super_ext_t ext;
+  readSuperExtension(&ext);
+  unsigned int *refcounts = NULL;
+  if (ext.refcount_len > 0) {
+    refcounts = new unsigned int[ext.refcount_len * UFS_BLOCK_SIZE / sizeof(unsigned int)];
+    readRefcountRegion(&ext, refcounts);
+  }
+
+  // Work out every block to rewrite before writing any of them, so the
+  // only failure (running out of space) leaves the disk untouched.
+  // Directory blocks a snapshot still sees get a private copy first.
+  vector<pair<int, char *> > writes;
+  char dstBlockBuffer[UFS_BLOCK_SIZE];
+  char movedDirBlock[UFS_BLOCK_SIZE];
+  bool metadataChanged = false;
+  int ret = 0;
+
+  if (srcParentInodeNumber == dstParentInodeNumber) {
+    // a rename in place touches a single entry
+    int block = entryIdx / entriesPerBlock;
+    memset(srcEntries[entryIdx].name, 0, DIR_ENT_NAME_SIZE);
+    strncpy(srcEntries[entryIdx].name, dstName.c_str(), DIR_ENT_NAME_SIZE);
+    ret = unshareBlock(&super, srcParent.direct[block], dataBitMap, refcounts);
+    if (ret >= 0) {
+      metadataChanged = ret != (int) srcParent.direct[block];
+      srcParent.direct[block] = ret;
+      writes.push_back(make_pair(ret, srcBuffer + block * UFS_BLOCK_SIZE));
+    }
+  } else {
+    metadataChanged = true;
+    // append to the destination; like create(), a directory never grows
+    // past its one block, since lookup and unlink only read direct[0]
+    int dstCount = dstParent.size / sizeof(dir_ent_t);
+    if (dstCount >= entriesPerBlock) {
+      ret = -ENOTENOUGHSPACE;
+    } else {
+      disk->readBlock(dstParent.direct[0], dstBlockBuffer);
+      ret = unshareBlock(&super, dstParent.direct[0], dataBitMap, refcounts);
+    }
+    if (ret >= 0) {
+      dir_ent_t *dstEntry = (dir_ent_t *) dstBlockBuffer + dstCount;
+      *dstEntry = srcEntries[entryIdx];
+      memset(dstEntry->name, 0, DIR_ENT_NAME_SIZE);
+      strncpy(dstEntry->name, dstName.c_str(), DIR_ENT_NAME_SIZE);
+      dstParent.direct[0] = ret;
+      dstParent.size += sizeof(dir_ent_t);
+      writes.push_back(make_pair(ret, dstBlockBuffer));
+    }
+
+    // close the gap in the source, keeping the order like unlink does
+    if (ret >= 0) {
+      for (int i = entryIdx; i < srcCount - 1; i++) {
+        srcEntries[i] = srcEntries[i + 1];
+      }
+      srcParent.size -= sizeof(dir_ent_t);
+      int keptBlocks = (srcParent.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+      for (int i = entryIdx / entriesPerBlock; i < keptBlocks && ret >= 0; i++) {
+        ret = unshareBlock(&super, srcParent.direct[i], dataBitMap, refcounts);
+        if (ret >= 0) {
+          srcParent.direct[i] = ret;
+          writes.push_back(make_pair(ret, srcBuffer + i * UFS_BLOCK_SIZE));
+        }
+      }
+      if (ret >= 0 && keptBlocks < srcBlocks) {
+        releaseDataBlock(srcParent.direct[srcBlocks - 1] - super.data_region_addr, dataBitMap, refcounts, NULL);
+      }
+    }
+
+    // a directory that changes parent needs its '..' pointed at the new one
+    if (ret >= 0 && inode.type == UFS_DIRECTORY) {
+      disk->readBlock(inode.direct[0], movedDirBlock);
+      ((dir_ent_t *) movedDirBlock)[1].inum = dstParentInodeNumber;
+      ret = unshareBlock(&super, inode.direct[0], dataBitMap, refcounts);
+      if (ret >= 0) {
+        inode.direct[0] = ret;
+        writes.push_back(make_pair(ret, movedDirBlock));
+      }
+    }
+  }
+
+  if (ret < 0) {
+    delete[] srcBuffer;
+    delete[] dataBitMap;
+    delete[] refcounts;
+    return -ENOTENOUGHSPACE;
+  }
+
+  for (size_t i = 0; i < writes.size(); i++) {
+    disk->writeBlock(writes[i].first, writes[i].second);
+  }
+
+  // a plain rename in place leaves sizes and block pointers alone
+  if (metadataChanged) {
+    inode_t *inodes = new inode_t[super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
+    readInodeRegion(&super, inodes);
+    inodes[srcParentInodeNumber] = srcParent;
+    if (dstParentInodeNumber != srcParentInodeNumber) {
+      inodes[dstParentInodeNumber] = dstParent;
+    }
+    if (inode.type == UFS_DIRECTORY) {
+      inodes[inodeNumber].direct[0] = inode.direct[0];
+    }
+    writeInodeRegion(&super, inodes);
+    writeDataBitmap(&super, dataBitMap);
+    if (refcounts != NULL) {
+      writeRefcountRegion(&ext, refcounts);
+    }
+    delete[] inodes;
+  }
+
+  delete[] refcounts;
+  delete[] srcBuffer;
+  delete[] dataBitMap;
+  return 0;
+}
+
+void LocalFileSystem::beginBatch() {
+  super_t super;
+  readSuperBlock(&super);
+  super_ext_t ext;
+  readSuperExtension(&ext);
+
+  int addrs[REGION_COUNT] = {super.inode_bitmap_addr, super.data_bitmap_addr, super.inode_region_addr,
+                             ext.refcount_addr, ext.fingerprint_addr, ext.inode_ext_addr};
+  int lens[REGION_COUNT] = {super.inode_bitmap_len, super.data_bitmap_len, super.inode_region_len,
+                            ext.refcount_len, ext.fingerprint_len, ext.inode_ext_len};
+  for (int r = 0; r < REGION_COUNT; r++) {
+    batchRegions[r].addr = addrs[r];
+    batchRegions[r].len = lens[r];
+    batchRegions[r].dirty = false;
+    batchRegions[r].data = new unsigned char[(size_t) lens[r] * UFS_BLOCK_SIZE];
+    readRegion(r, addrs[r], lens[r], batchRegions[r].data);
+  }
+  batching = true;
+}
+
+void LocalFileSystem::endBatch(bool flush) {
+  batching = false;
+  for (int r = 0; r < REGION_COUNT; r++) {
+    if (flush && batchRegions[r].dirty) {
+      writeRegion(r, batchRegions[r].addr, batchRegions[r].len, batchRegions[r].data);
+    }
+    delete[] batchRegions[r].data;
+    batchRegions[r].data = NULL;
+  }
+}
+
+int LocalFileSystem::batch(vector<BatchOp> &ops) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+
+  disk->beginTransaction();
+  beginBatch();
+
+  int ret = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    BatchOp &op = ops[i];
+    int inodeNumber = op.inodeNumber;
+    if (inodeNumber == BATCH_PREVIOUS) {
+      inodeNumber = i > 0 ? ops[i - 1].result : -EINVALIDINODE;
+    }
+
+    if (inodeNumber < 0) {
+      op.result = -EINVALIDINODE;
+    } else if (op.op == BATCH_LOOKUP) {
+      op.result = lookup(inodeNumber, op.name);
+    } else if (op.op == BATCH_CREATE) {
+      op.result = create(inodeNumber, op.type, op.name);
+    } else if (op.op == BATCH_WRITE) {
+      op.result = write(inodeNumber, op.buffer, op.size);
+    } else if (op.op == BATCH_UNLINK) {
+      op.result = unlink(inodeNumber, op.name);
+    } else {
+      op.result = -EINVALIDTYPE;
+    }
+
+    if (op.result < 0) {
+      ret = op.result;
+      break;
+    }
+  }
+
+  if (ret < 0) {
+    endBatch(false);
+    disk->rollback();
+    return ret;
+  }
+  endBatch(true);
+  disk->commit();
+  return ops.size();
+}
+
+int LocalFileSystem::beginWrite(int inodeNumber) {
+  if (snapshotBase >= 0) {
+    return -EREADONLY;
+  }
+  if (streamInode >= 0 || batching) {
+    return -EINVALIDINODE;
+  }
+
+  disk->beginTransaction();
+  beginBatch();
+  int ret = write(inodeNumber, NULL, 0);
+  if (ret < 0) {
+    endBatch(false);
+    disk->rollback();
+    return ret;
+  }
+  streamInode = inodeNumber;
+  streamError = 0;
+  return 0;
+}
+
+int LocalFileSystem::appendChunk(const void *buffer, int size) {
+  if (streamInode < 0) {
+    return -EINVALIDINODE;
+  }
+  if (streamError < 0) {
+    return streamError;
+  }
+  int ret = storeFile(streamInode, (const char *) buffer, size, true);
+  if (ret < 0) {
+    streamError = ret;
+  }
+  return ret;
+}
+
+int LocalFileSystem::endWrite(bool commit) {
+  if (streamInode < 0) {
+    return -EINVALIDINODE;
+  }
+
+  inode_t inode;
+  int ret = streamError < 0 ? streamError : stat(streamInode, &inode);
+  streamInode = -1;
+
+  if (!commit || ret < 0) {
+    endBatch(false);
+    disk->rollback();
+    return ret;
+  }
+  endBatch(true);
+  disk->commit();
+  return inode.size;
+}
@@ -8,7 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-MyServerSocket::MyServerSocket(int port)
+MyServerSocket::MyServerSocket(int port, int backlog, bool reusePort)
 {
     struct sockaddr_in server;
     int one = 1;
@@ -23,6 +23,9 @@ MyServerSocket::MyServerSocket(int port)
     if (setsockopt(serverFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(int)) == -1) {
       throw SocketError("error with set socket opts");
     }
+    if (reusePort && setsockopt(serverFd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(int)) == -1) {
+      throw SocketError("error with set socket opts");
+    }
     
     if( bind(serverFd,(struct sockaddr *) &server, sizeof(server)) ==-1){
         char str[1024];
@@ -31,7 +34,7 @@ MyServerSocket::MyServerSocket(int port)
     }	
     
     //set up a listen queue
-    listen(serverFd, 10);
+    listen(serverFd, backlog);
 }
 
 MySocket *MyServerSocket::accept()
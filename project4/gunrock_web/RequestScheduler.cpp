@@ -0,0 +1,85 @@
+#include <string>
+
+#include "RequestScheduler.h"
+
+using namespace std;
+
+RequestScheduler *RequestScheduler::create(string name) {
+  if (name == "FIFO") {
+    return new FifoScheduler();
+  } else if (name == "SFF") {
+    return new SmallestFileFirstScheduler();
+  } else if (name == "FAIR") {
+    return new FairScheduler();
+  }
+  return NULL;
+}
+
+void FifoScheduler::put(const QueuedRequest &request) {
+  queue.push_back(request);
+}
+
+QueuedRequest FifoScheduler::take() {
+  QueuedRequest request = queue.front();
+  queue.pop_front();
+  return request;
+}
+
+size_t FifoScheduler::size() {
+  return queue.size();
+}
+
+bool SmallestFileFirstScheduler::LargerCost::operator()(const QueuedRequest &a, const QueuedRequest &b) const {
+  // priority_queue pops the largest, so "larger" here means served later.
+  // cost - AGING * (now - arrival) orders the same for every `now`, so
+  // ranking by cost + AGING * arrival ages requests without re-sorting.
+  long long agedA = a.cost + SFF_AGING_BYTES_PER_MS * a.arrivalMs;
+  long long agedB = b.cost + SFF_AGING_BYTES_PER_MS * b.arrivalMs;
+  if (agedA != agedB) {
+    return agedA > agedB;
+  }
+  return a.sequence > b.sequence;
+}
+
+void SmallestFileFirstScheduler::put(const QueuedRequest &request) {
+  queue.push(request);
+}
+
+QueuedRequest SmallestFileFirstScheduler::take() {
+  QueuedRequest request = queue.top();
+  queue.pop();
+  return request;
+}
+
+size_t SmallestFileFirstScheduler::size() {
+  return queue.size();
+}
+
+void FairScheduler::put(const QueuedRequest &request) {
+  deque<QueuedRequest> &queue = queues[request.clientKey];
+  if (queue.empty()) {
+    turns.push_back(request.clientKey);
+  }
+  queue.push_back(request);
+  count++;
+}
+
+QueuedRequest FairScheduler::take() {
+  string clientKey = turns.front();
+  turns.pop_front();
+
+  deque<QueuedRequest> &queue = queues[clientKey];
+  QueuedRequest request = queue.front();
+  queue.pop_front();
+  if (queue.empty()) {
+    queues.erase(clientKey);
+  } else {
+    turns.push_back(clientKey);
+  }
+  count--;
+  return request;
+}
+
+size_t FairScheduler::size() {
+  return count;
+}
@@ -0,0 +1,218 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Microbenchmarks for LocalFileSystem on fresh images. Every combination
+// of image size, Disk backend, directory size and file size runs the same
+// sequence: create N files in a new directory, then lookup, stat, write,
+// read and unlink each of them. Each operation is timed on its own and
+// the Disk counters are sampled around it, so results show both latency
+// and how many blocks and fsyncs an operation costs.
+
+struct ImageConfig {
+  const char *name;
+  int numInodes;
+  int numData;
+};
+
+struct BackendConfig {
+  const char *name;
+  int cacheBlocks;  // Disk cache capacity, 0 for none
+};
+
+static const ImageConfig images[] = {
+  {"small", 512, 8192},
+  {"large", 16384, 131072},
+};
+
+static const BackendConfig backends[] = {
+  {"cached", 1024},
+  {"uncached", 0},
+};
+
+// create() keeps a directory in one block, room for 126 entries besides . and ..
+static const int directorySizes[] = {16, 120};
+static const int fileSizes[] = {UFS_BLOCK_SIZE / 2, 4 * UFS_BLOCK_SIZE, MAX_FILE_SIZE};
+
+// Latencies and Disk counter totals for one operation type
+struct OpResult {
+  vector<double> micros;
+  DiskStats totals;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void addStats(DiskStats *totals, const DiskStats &delta) {
+  totals->blockReads += delta.blockReads;
+  totals->readaheadReads += delta.readaheadReads;
+  totals->cacheHits += delta.cacheHits;
+  totals->blockWrites += delta.blockWrites;
+  totals->syncs += delta.syncs;
+}
+
+// Time one call and charge its Disk activity to `result`. Returns the
+// call's return value so the caller can check it.
+template <typename Op>
+static int measure(Disk *disk, OpResult *result, Op op) {
+  disk->resetStats();
+  double start = now();
+  int ret = op();
+  result->micros.push_back(now() - start);
+  addStats(&result->totals, disk->stats());
+  return ret;
+}
+
+static void report(const ImageConfig &image, const BackendConfig &backend, int entries, int fileSize,
+                   const char *opName, OpResult &result) {
+  vector<double> &micros = result.micros;
+  sort(micros.begin(), micros.end());
+  double total = 0;
+  for (size_t i = 0; i < micros.size(); i++) {
+    total += micros[i];
+  }
+  size_t n = micros.size();
+  double p50 = micros[n / 2];
+  double p99 = micros[min(n - 1, n * 99 / 100)];
+  printf("%s\t%s\t%d\t%d\t%s\t%zu\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.2f\n", image.name, backend.name, entries,
+         fileSize, opName, n, total > 0 ? n * 1e6 / total : 0.0, p50, p99,
+         (double) (result.totals.blockReads + result.totals.readaheadReads) / n,
+         (double) result.totals.blockWrites / n, (double) result.totals.cacheHits / n,
+         (double) result.totals.syncs / n);
+  fflush(stdout);
+}
+
+static bool runWorkload(const string &mkfs, const string &imagePath, const ImageConfig &image,
+                        const BackendConfig &backend, int entries, int fileSize) {
+  string command = mkfs + " -f " + imagePath + " -i " + to_string(image.numInodes) + " -d " +
+                   to_string(image.numData) + " > /dev/null";
+  if (system(command.c_str()) != 0) {
+    cerr << "Could not run " << command << endl;
+    return false;
+  }
+
+  Disk *disk = new Disk(imagePath, UFS_BLOCK_SIZE);
+  disk->setCacheCapacity(backend.cacheBlocks);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+
+  // same contents every run so results are repeatable
+  vector<char> data(fileSize);
+  for (int i = 0; i < fileSize; i++) {
+    data[i] = 'a' + (i * 7) % 26;
+  }
+  vector<char> buffer(MAX_FILE_SIZE);
+
+  int directory = fileSystem->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "bench");
+  vector<string> names;
+  for (int i = 0; i < entries; i++) {
+    names.push_back("file" + to_string(i));
+  }
+  vector<int> inodes(entries);
+
+  const char *opNames[] = {"create", "lookup", "stat", "write", "read", "unlink"};
+  OpResult results[6];
+  for (int r = 0; r < 6; r++) {
+    memset(&results[r].totals, 0, sizeof(DiskStats));
+  }
+
+  bool ok = directory >= 0;
+  for (int i = 0; i < entries && ok; i++) {
+    inodes[i] = measure(disk, &results[0], [&]() { return fileSystem->create(directory, UFS_REGULAR_FILE, names[i]); });
+    ok = inodes[i] >= 0;
+  }
+  for (int i = 0; i < entries && ok; i++) {
+    ok = measure(disk, &results[1], [&]() { return fileSystem->lookup(directory, names[i]); }) == inodes[i];
+  }
+  for (int i = 0; i < entries && ok; i++) {
+    inode_t inode;
+    ok = measure(disk, &results[2], [&]() { return fileSystem->stat(inodes[i], &inode); }) == 0;
+  }
+  for (int i = 0; i < entries && ok; i++) {
+    ok = measure(disk, &results[3], [&]() { return fileSystem->write(inodes[i], &data[0], fileSize); }) == fileSize;
+  }
+  for (int i = 0; i < entries && ok; i++) {
+    ok = measure(disk, &results[4], [&]() { return fileSystem->read(inodes[i], &buffer[0], fileSize); }) == fileSize &&
+         memcmp(&buffer[0], &data[0], fileSize) == 0;
+  }
+  for (int i = 0; i < entries && ok; i++) {
+    ok = measure(disk, &results[5], [&]() { return fileSystem->unlink(directory, names[i]); }) == 0;
+  }
+
+  if (ok) {
+    for (int r = 0; r < 6; r++) {
+      report(image, backend, entries, fileSize, opNames[r], results[r]);
+    }
+  } else {
+    cerr << "Workload failed: " << image.name << " " << backend.name << " " << entries << " files of "
+         << fileSize << " bytes" << endl;
+  }
+
+  delete fileSystem;
+  delete disk;
+  unlink(imagePath.c_str());
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  // -q runs only the small image and the smaller directory, -m names the
+  // mkfs binary and -t the directory scratch images are made in
+  bool quick = false;
+  string mkfs = "./mkfs";
+  string scratch = "/tmp";
+  int ch;
+  while ((ch = getopt(argc, argv, "+qm:t:")) != -1) {
+    if (ch == 'q') {
+      quick = true;
+    } else if (ch == 'm') {
+      mkfs = optarg;
+    } else if (ch == 't') {
+      scratch = optarg;
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc - optind != 0) {
+    cerr << argv[0] << ": [-q] [-m mkfs] [-t scratchDirectory]" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ make bench && " << argv[0] << " -q" << endl;
+    return 1;
+  }
+
+  string imagePath = scratch + "/ufsbench-" + to_string(getpid()) + ".img";
+
+  printf("image\tbackend\tentries\tfile_size\top\tcount\tops_per_sec\tp50_us\tp99_us\t"
+         "blocks_read_per_op\tblocks_written_per_op\tcache_hits_per_op\tfsyncs_per_op\n");
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]) && ok; i++) {
+    if (quick && i > 0) {
+      break;
+    }
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]) && ok; b++) {
+      for (size_t d = 0; d < sizeof(directorySizes) / sizeof(directorySizes[0]) && ok; d++) {
+        if (quick && d > 0) {
+          break;
+        }
+        for (size_t f = 0; f < sizeof(fileSizes) / sizeof(fileSizes[0]) && ok; f++) {
+          ok = runWorkload(mkfs, imagePath, images[i], backends[b], directorySizes[d], fileSizes[f]);
+        }
+      }
+    }
+  }
+  return ok ? 0 : 1;
+}
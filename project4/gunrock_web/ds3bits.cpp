@@ -2,6 +2,9 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -9,52 +12,240 @@
 
 using namespace std;
 
+// heat map cells per row and at most this many rows per bitmap
+#define HEATMAP_COLUMNS (64)
+#define HEATMAP_ROWS (16)
+
+static bool isSet(const unsigned char *bitmap, long long bit) {
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+// 64 bits of the bitmap starting at `bit`, which must be a multiple of 64
+static uint64_t wordAt(const unsigned char *bitmap, long long bit) {
+    uint64_t word;
+    memcpy(&word, bitmap + bit / 8, sizeof(word));
+    return word;
+}
+
+// popcount of `words` whole words from `bit` on. Built twice on x86: the
+// Makefile targets no particular CPU, so the plain build calls libgcc's
+// table-driven helper, and a copy compiled for popcnt is used when the
+// CPU has the instruction.
+static long long countWords(const unsigned char *bitmap, long long bit, long long words) {
+    long long count = 0;
+    for (long long i = 0; i < words; i++) {
+        count += __builtin_popcountll(wordAt(bitmap, bit + i * 64));
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt")))
+static long long countWordsPopcnt(const unsigned char *bitmap, long long bit, long long words) {
+    long long count = 0;
+    for (long long i = 0; i < words; i++) {
+        count += __builtin_popcountll(wordAt(bitmap, bit + i * 64));
+    }
+    return count;
+}
+#endif
+
+// Set bits in [from, to), a word at a time in the middle
+static long long countSet(const unsigned char *bitmap, long long from, long long to) {
+    long long count = 0;
+    long long bit = from;
+    for (; bit < to && bit % 64 != 0; bit++) {
+        count += isSet(bitmap, bit);
+    }
+    long long words = (to - bit) / 64;
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool hasPopcnt = __builtin_cpu_supports("popcnt");
+    count += hasPopcnt ? countWordsPopcnt(bitmap, bit, words) : countWords(bitmap, bit, words);
+#else
+    count += countWords(bitmap, bit, words);
+#endif
+    for (bit += words * 64; bit < to; bit++) {
+        count += isSet(bitmap, bit);
+    }
+    return count;
+}
+
+static void appendSummary(string *out, const char *name, const unsigned char *bitmap, long long bits) {
+    long long used = countSet(bitmap, 0, bits);
+    char line[128];
+    snprintf(line, sizeof(line), "%s used %lld free %lld total %lld (%.1f%% used)\n", name, used, bits - used, bits,
+             bits > 0 ? 100.0 * used / bits : 0.0);
+    *out += line;
+}
+
+// Free extents bucketed by length in powers of two: a disk with plenty
+// of free blocks but only short extents is fragmented.
+static void appendHistogram(string *out, const char *name, const unsigned char *bitmap, long long bits) {
+    long long extents[64] = {0};
+    long long blocks[64] = {0};
+    long long run = 0;
+    long long bit = 0;
+    while (bit < bits) {
+        // whole words that are all used or all free are skipped in one step
+        if (bit % 64 == 0 && bit + 64 <= bits) {
+            uint64_t word = wordAt(bitmap, bit);
+            if (word == 0) {
+                run += 64;
+                bit += 64;
+                continue;
+            }
+            if (word == ~(uint64_t) 0 && run == 0) {
+                bit += 64;
+                continue;
+            }
+        }
+        if (!isSet(bitmap, bit)) {
+            run++;
+        } else if (run > 0) {
+            int bucket = 63 - __builtin_clzll(run);
+            extents[bucket]++;
+            blocks[bucket] += run;
+            run = 0;
+        }
+        bit++;
+    }
+    if (run > 0) {
+        int bucket = 63 - __builtin_clzll(run);
+        extents[bucket]++;
+        blocks[bucket] += run;
+    }
+
+    *out += name;
+    *out += " free extents\n";
+    char line[128];
+    for (int b = 0; b < 64; b++) {
+        if (extents[b] == 0) {
+            continue;
+        }
+        long long low = 1LL << b;
+        long long high = (low << 1) - 1;
+        if (low == high) {
+            snprintf(line, sizeof(line), "%lld\textents %lld blocks %lld\n", low, extents[b], blocks[b]);
+        } else {
+            snprintf(line, sizeof(line), "%lld-%lld\textents %lld blocks %lld\n", low, high, extents[b], blocks[b]);
+        }
+        *out += line;
+    }
+}
+
+// One character per cell of the bitmap, from ' ' (all free) to '@' (all
+// used). Cells are sized so the map is at most HEATMAP_ROWS lines.
+static void appendHeatMap(string *out, const char *name, const unsigned char *bitmap, long long bits) {
+    static const char shades[] = " .:-=+*#%@";
+    long long cells = HEATMAP_COLUMNS * HEATMAP_ROWS;
+    long long cellSize = max(1LL, (bits + cells - 1) / cells);
+    char line[128];
+    snprintf(line, sizeof(line), "%s heat map, %lld per cell\n", name, cellSize);
+    *out += line;
+
+    int column = 0;
+    for (long long from = 0; from < bits; from += cellSize) {
+        long long to = min(bits, from + cellSize);
+        long long used = countSet(bitmap, from, to);
+        // only completely free and completely used cells get the ends
+        int shade = used == 0 ? 0 : used == to - from ? 9 : 1 + (int) (used * 8 / (to - from));
+        *out += shades[shade];
+        if (++column == HEATMAP_COLUMNS) {
+            *out += '\n';
+            column = 0;
+        }
+    }
+    if (column > 0) {
+        *out += '\n';
+    }
+}
+
+// The classic byte-per-value dump, formatted into one buffer
+static void appendBytes(string *out, const unsigned char *bitmap, int bytes) {
+    char text[8];
+    for (int i = 0; i < bytes; i++) {
+        int length = snprintf(text, sizeof(text), "%u ", (unsigned int) bitmap[i]);
+        out->append(text, length);
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        cerr << argv[0] << ": diskImageFile" << endl;
+    // -c prints used/free counts, -H a histogram of free extent lengths
+    // and -m a heat map of each bitmap instead of the raw bytes
+    bool summary = false;
+    bool histogram = false;
+    bool heatMap = false;
+    int ch;
+    while ((ch = getopt(argc, argv, "+cHm")) != -1) {
+        if (ch == 'c') {
+            summary = true;
+        } else if (ch == 'H') {
+            histogram = true;
+        } else if (ch == 'm') {
+            heatMap = true;
+        } else {
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 1) {
+        cerr << argv[0] << ": [-c] [-H] [-m] diskImageFile" << endl;
         return 1;
     }
 
-    Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+    Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
     LocalFileSystem *fileSystem = new LocalFileSystem(disk);
 
     super_t super;
     fileSystem->readSuperBlock(&super);
 
-    cout << "Super" << endl;
-    cout << "inode_region_addr " << super.inode_region_addr << endl;
-    cout << "inode_region_len " << super.inode_region_len << endl;
-    cout << "num_inodes " << super.num_inodes << endl;
-    cout << "data_region_addr " << super.data_region_addr << endl;
-    cout << "data_region_len " << super.data_region_len << endl;
-    cout << "num_data " << super.num_data << endl;
-    cout << endl;
-
-    cout << "Inode bitmap" <<endl;
-
     int inodeMapSize = UFS_BLOCK_SIZE * super.inode_bitmap_len;
     unsigned char *inodeBitMap = new unsigned char[inodeMapSize];
     fileSystem->readInodeBitmap(&super, inodeBitMap);
 
-    for (int i = 0; i < super.num_inodes / 8; i++) {
-      cout << (unsigned int) inodeBitMap[i] << " ";
-    }
-
-    cout << endl << endl;
-
-    
-
-    cout << "Data bitmap" <<endl;
-
     int dataMapSize = UFS_BLOCK_SIZE * super.data_bitmap_len;
     unsigned char *dataBitMap = new unsigned char[dataMapSize];
     fileSystem->readDataBitmap(&super, dataBitMap);
 
-    for (int i = 0; i < super.num_data / 8; i++) {
-      cout << (unsigned int) dataBitMap[i] << " ";
-    }
+    long long numInodes = min((long long) super.num_inodes, 8LL * inodeMapSize);
+    long long numData = min((long long) super.num_data, 8LL * dataMapSize);
+
+    string out;
+    if (summary || histogram || heatMap) {
+        if (summary) {
+            appendSummary(&out, "inodes", inodeBitMap, numInodes);
+            appendSummary(&out, "data", dataBitMap, numData);
+        }
+        if (histogram) {
+            out += summary ? "\n" : "";
+            appendHistogram(&out, "data", dataBitMap, numData);
+        }
+        if (heatMap) {
+            out += summary || histogram ? "\n" : "";
+            appendHeatMap(&out, "inodes", inodeBitMap, numInodes);
+            out += "\n";
+            appendHeatMap(&out, "data", dataBitMap, numData);
+        }
+    } else {
+        out += "Super\n";
+        out += "inode_region_addr " + to_string(super.inode_region_addr) + "\n";
+        out += "inode_region_len " + to_string(super.inode_region_len) + "\n";
+        out += "num_inodes " + to_string(super.num_inodes) + "\n";
+        out += "data_region_addr " + to_string(super.data_region_addr) + "\n";
+        out += "data_region_len " + to_string(super.data_region_len) + "\n";
+        out += "num_data " + to_string(super.num_data) + "\n";
+        out += "\n";
 
-    cout << endl;
+        out += "Inode bitmap\n";
+        appendBytes(&out, inodeBitMap, super.num_inodes / 8);
+        out += "\n\n";
+
+        out += "Data bitmap\n";
+        appendBytes(&out, dataBitMap, super.num_data / 8);
+        out += "\n";
+    }
+    cout.write(out.data(), out.size());
+    cout.flush();
 
     delete[] inodeBitMap;
     delete[] dataBitMap;
@@ -12,14 +12,33 @@
 using namespace std;
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-      cerr << argv[0] << ": diskImageFile inodeNumber" << endl;
+  // -s reads the file as it was in a snapshot
+  string snapshot;
+  int ch;
+  while ((ch = getopt(argc, argv, "+s:")) != -1) {
+    if (ch == 's') {
+      snapshot = optarg;
+    } else {
+      argc = 0;
+    }
+  }
+
+  if (argc - optind != 2) {
+      cerr << argv[0] << ": [-s snapshot] diskImageFile inodeNumber" << endl;
       return 1;
   }
 
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  // snapshots don't change under us, so reading one needs no lock
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE, snapshot.empty());
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
-  int inodeNumber = stoi(argv[2]);
+  int inodeNumber = stoi(argv[optind + 1]);
+
+  if (!snapshot.empty() && fileSystem->openSnapshot(snapshot) < 0) {
+      cerr << "Error reading file" << endl;
+      delete fileSystem;
+      delete disk;
+      return 1;
+  }
 
   if (dup2(fileno(stdout), STDOUT_FILENO) == -1) {
       cerr << "Error reading file" << endl;
@@ -50,7 +69,7 @@ int main(int argc, char *argv[]) {
   unsigned char *dataBitmap = new unsigned char[bitMapSize];
   fileSystem->readDataBitmap(&super, dataBitmap);
 
-  int blockUsed = (inode.size + 4095) / 4096;
+  int blockUsed = fileSystem->blockCount(inodeNumber);
 
   cout << "File blocks" << endl;
   for (int i = 0; i < blockUsed; i++) {
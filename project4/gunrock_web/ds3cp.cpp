@@ -2,10 +2,10 @@
 #include <string>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/uio.h>
 #include <unistd.h>
 
 #include "LocalFileSystem.h"
@@ -14,9 +14,133 @@
 
 using namespace std;
 
+// The source is copied through a small ring of block-sized chunks: a
+// reader thread fills them from the host file while the main thread
+// appends them to the image, so memory use does not depend on file size.
+#define CHUNK_SIZE (8 * UFS_BLOCK_SIZE)
+#define CHUNK_SLOTS (4)
+
+struct Chunk {
+  char data[CHUNK_SIZE];
+  ssize_t length;  // bytes read, 0 at end of file, -1 on a read error
+};
+
+struct CopyState {
+  int fd;
+  Chunk slots[CHUNK_SLOTS];
+  long long filled;    // chunks the reader has produced
+  long long consumed;  // chunks the writer has finished with
+  bool stopping;       // the writer wants no more chunks
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+static void *readSource(void *arg) {
+  CopyState *state = (CopyState *) arg;
+  bool done = false;
+  while (!done) {
+    pthread_mutex_lock(&state->lock);
+    while (state->filled - state->consumed == CHUNK_SLOTS && !state->stopping) {
+      pthread_cond_wait(&state->changed, &state->lock);
+    }
+    if (state->stopping) {
+      pthread_mutex_unlock(&state->lock);
+      break;
+    }
+    Chunk &chunk = state->slots[state->filled % CHUNK_SLOTS];
+    pthread_mutex_unlock(&state->lock);
+
+    // fill the whole chunk unless the file ends first
+    ssize_t total = 0;
+    ssize_t ret = 0;
+    while (total < CHUNK_SIZE && (ret = read(state->fd, chunk.data + total, CHUNK_SIZE - total)) > 0) {
+      total += ret;
+    }
+    chunk.length = ret < 0 ? -1 : total;
+    done = chunk.length <= 0;
+
+    pthread_mutex_lock(&state->lock);
+    state->filled++;
+    pthread_cond_broadcast(&state->changed);
+    pthread_mutex_unlock(&state->lock);
+  }
+  return NULL;
+}
+
+// Stream the source into dstInode. Returns false on any error, leaving
+// the file as it was.
+static bool copyFile(LocalFileSystem *fileSystem, int fd, int dstInode) {
+  if (fileSystem->beginWrite(dstInode) < 0) {
+    return false;
+  }
+
+  CopyState *state = new CopyState;
+  state->fd = fd;
+  state->filled = 0;
+  state->consumed = 0;
+  state->stopping = false;
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->changed, NULL);
+  pthread_t reader;
+  pthread_create(&reader, NULL, readSource, state);
+
+  bool ok = true;
+  while (true) {
+    pthread_mutex_lock(&state->lock);
+    while (state->filled == state->consumed) {
+      pthread_cond_wait(&state->changed, &state->lock);
+    }
+    Chunk &chunk = state->slots[state->consumed % CHUNK_SLOTS];
+    pthread_mutex_unlock(&state->lock);
+
+    if (chunk.length < 0) {
+      ok = false;
+      break;
+    }
+    if (chunk.length == 0) {
+      break;
+    }
+    // a short append means the file or the disk is full; like write(),
+    // keep what fit
+    int appended = fileSystem->appendChunk(chunk.data, chunk.length);
+    if (appended < 0) {
+      ok = false;
+      break;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->consumed++;
+    pthread_cond_broadcast(&state->changed);
+    pthread_mutex_unlock(&state->lock);
+    if (appended < chunk.length) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&state->lock);
+  state->stopping = true;
+  pthread_cond_broadcast(&state->changed);
+  pthread_mutex_unlock(&state->lock);
+  pthread_join(reader, NULL);
+  delete state;
+
+  return fileSystem->endWrite(ok) >= 0 && ok;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    cerr << argv[0] << ": diskImageFile src_file dst_inode" << endl;
+  // -z stores the file compressed (needs an image made with mkfs -C)
+  bool compress = false;
+  int ch;
+  while ((ch = getopt(argc, argv, "+z")) != -1) {
+    if (ch == 'z') {
+      compress = true;
+    } else {
+      argc = 0;
+    }
+  }
+
+  if (argc - optind != 3) {
+    cerr << argv[0] << ": [-z] diskImageFile src_file dst_inode" << endl;
     cerr << "For example:" << endl;
     cerr << "    $ " << argv[0] << " tests/disk_images/a.img dthread.cpp 3" << endl;
     return 1;
@@ -24,10 +148,10 @@ int main(int argc, char *argv[]) {
 
   // Parse command line arguments
 
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
-  string srcFile = string(argv[2]);
-  int dstInode = stoi(argv[3]);
+  string srcFile = string(argv[optind + 1]);
+  int dstInode = stoi(argv[optind + 2]);
 
   int fd = open(srcFile.c_str(), O_RDONLY);
   if (fd < 0) {
@@ -36,41 +160,24 @@ int main(int argc, char *argv[]) {
     delete disk;
     return 1;
   }
+  (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  struct stat fileStat;
-    if (fstat(fd, &fileStat) < 0) {
-      cerr << "Could not write to dst_file" << endl;
-      close(fd);
-      delete fileSystem;
-      delete disk;
-      return 1;
-    }
-
-  off_t fileSize = fileStat.st_size;
-
-  char *buffer = new char[fileSize];
-  ssize_t bytesRead = read(fd, buffer, fileSize);
-
-  if (bytesRead < 0) {
+  if (compress && fileSystem->setCompressed(dstInode, true) < 0) {
     cerr << "Could not write to dst_file" << endl;
-    delete[] buffer;
     close(fd);
     delete fileSystem;
     delete disk;
     return 1;
   }
 
-  int bytesWritten = fileSystem->write(dstInode, buffer, bytesRead);
-  if (bytesWritten < 0) {
+  if (!copyFile(fileSystem, fd, dstInode)) {
     cerr << "Could not write to dst_file" << endl;
-    delete[] buffer;
     close(fd);
     delete fileSystem;
     delete disk;
     return 1;
   }
 
-  delete[] buffer;
   close(fd);
   delete fileSystem;
   delete disk;
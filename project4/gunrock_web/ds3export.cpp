@@ -0,0 +1,320 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "StringUtils.h"
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define TAR_BLOCK (512)
+
+struct ExportEntry {
+  string path;   // relative path in the archive, directories end in '/'
+  int inodeNumber;
+};
+
+// Shared state of the directory walk. Workers pop a directory, list it,
+// record its entries and queue its subdirectories.
+struct WalkState {
+  Disk *disk;
+  super_t super;
+  inode_t *inodes;
+  deque<ExportEntry> queue;
+  int busy;
+  vector<ExportEntry> found;
+  bool corrupt;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+static bool validInode(WalkState *state, int inodeNumber) {
+  return inodeNumber >= 0 && inodeNumber < state->super.num_inodes;
+}
+
+static void *walkDirectories(void *arg) {
+  WalkState *state = (WalkState *) arg;
+
+  pthread_mutex_lock(&state->lock);
+  while (true) {
+    if (state->queue.empty()) {
+      if (state->busy == 0) {
+        break;
+      }
+      pthread_cond_wait(&state->changed, &state->lock);
+      continue;
+    }
+    ExportEntry dir = state->queue.front();
+    state->queue.pop_front();
+    state->busy++;
+    pthread_mutex_unlock(&state->lock);
+
+    // every block of the directory in one go
+    inode_t &inode = state->inodes[dir.inodeNumber];
+    int blocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    vector<char> buffer((size_t) max(blocks, 1) * UFS_BLOCK_SIZE);
+    bool corrupt = blocks > DIRECT_PTRS;
+    for (int i = 0; i < blocks && !corrupt; i++) {
+      int block = inode.direct[i];
+      if (block < state->super.data_region_addr || block >= state->super.data_region_addr + state->super.num_data) {
+        corrupt = true;
+        break;
+      }
+      state->disk->readBlock(block, &buffer[(size_t) i * UFS_BLOCK_SIZE]);
+    }
+
+    vector<ExportEntry> children;
+    vector<ExportEntry> subdirectories;
+    dir_ent_t *entries = (dir_ent_t *) &buffer[0];
+    int count = corrupt ? 0 : inode.size / sizeof(dir_ent_t);
+    for (int i = 0; i < count; i++) {
+      string name(entries[i].name, strnlen(entries[i].name, DIR_ENT_NAME_SIZE));
+      if (name == "." || name == "..") {
+        continue;
+      }
+      if (!validInode(state, entries[i].inum)) {
+        corrupt = true;
+        continue;
+      }
+      ExportEntry child;
+      child.inodeNumber = entries[i].inum;
+      child.path = dir.path + name;
+      if (state->inodes[child.inodeNumber].type == UFS_DIRECTORY) {
+        child.path += "/";
+        subdirectories.push_back(child);
+      }
+      children.push_back(child);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->found.insert(state->found.end(), children.begin(), children.end());
+    state->queue.insert(state->queue.end(), subdirectories.begin(), subdirectories.end());
+    state->corrupt = state->corrupt || corrupt;
+    state->busy--;
+    pthread_cond_broadcast(&state->changed);
+  }
+  pthread_mutex_unlock(&state->lock);
+  return NULL;
+}
+
+static void writeAll(const char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t ret = write(STDOUT_FILENO, buffer, length);
+    if (ret <= 0) {
+      cerr << "Error writing archive" << endl;
+      exit(1);
+    }
+    buffer += ret;
+    length -= ret;
+  }
+}
+
+// A ustar header. Paths too long for `name` are split into prefix/name.
+static bool writeHeader(const string &path, bool isDirectory, int size) {
+  char header[TAR_BLOCK];
+  memset(header, 0, sizeof(header));
+
+  string prefix;
+  string name = path;
+  if (name.length() > 100) {
+    // the rightmost '/' that keeps the prefix within 155 characters
+    // leaves the shortest name; if even that is over 100, nothing fits
+    size_t last = path.length() - (isDirectory ? 2 : 1);
+    size_t split = path.rfind('/', last < 155 ? last : 155);
+    if (split == string::npos || path.length() - split - 1 > 100) {
+      return false;
+    }
+    prefix = path.substr(0, split);
+    name = path.substr(split + 1);
+  }
+
+  memcpy(header, name.data(), name.length());
+  snprintf(header + 100, 8, "%07o", isDirectory ? 0755 : 0644);
+  snprintf(header + 108, 8, "%07o", 0);
+  snprintf(header + 116, 8, "%07o", 0);
+  snprintf(header + 124, 12, "%011o", size);
+  snprintf(header + 136, 12, "%011o", 0);
+  header[156] = isDirectory ? '5' : '0';
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  memcpy(header + 345, prefix.data(), prefix.length());
+
+  // the checksum is computed with its own field set to spaces
+  memset(header + 148, ' ', 8);
+  unsigned int checksum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++) {
+    checksum += (unsigned char) header[i];
+  }
+  snprintf(header + 148, 8, "%06o", checksum);
+  header[155] = ' ';
+
+  writeAll(header, TAR_BLOCK);
+  return true;
+}
+
+// Plain files are read as runs of consecutive blocks, one read per run.
+static bool readFile(Disk *disk, super_t *super, inode_t *inode, char *buffer) {
+  int blocks = (inode->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  if (blocks > DIRECT_PTRS) {
+    return false;
+  }
+  int i = 0;
+  while (i < blocks) {
+    int run = 1;
+    while (i + run < blocks && inode->direct[i + run] == inode->direct[i] + run) {
+      run++;
+    }
+    if ((int) inode->direct[i] < super->data_region_addr ||
+        (int) inode->direct[i] + run > super->data_region_addr + super->num_data) {
+      return false;
+    }
+    disk->readBlocks(inode->direct[i], run, buffer + (size_t) i * UFS_BLOCK_SIZE);
+    i += run;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  // -s exports the tree as it was in a snapshot, so a live server can
+  // keep running; -j sets the number of directory walkers
+  string snapshot;
+  int threads = 4;
+  int ch;
+  while ((ch = getopt(argc, argv, "+s:j:")) != -1) {
+    if (ch == 's') {
+      snapshot = optarg;
+    } else if (ch == 'j' && atoi(optarg) > 0) {
+      threads = atoi(optarg);
+    } else {
+      argc = 0;
+    }
+  }
+
+  if (argc - optind != 2) {
+    cerr << argv[0] << ": [-s snapshot] [-j threads] diskImageFile path > archive.tar" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " tests/disk_images/a.img /a | tar -tvf -" << endl;
+    return 1;
+  }
+
+  // snapshots don't change under us, so reading one needs no lock
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE, snapshot.empty());
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  if (!snapshot.empty() && fileSystem->openSnapshot(snapshot) < 0) {
+    cerr << "Snapshot not found" << endl;
+    delete fileSystem;
+    delete disk;
+    return 1;
+  }
+
+  vector<string> components = StringUtils::split(argv[optind + 1], '/');
+  int rootInode = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  for (size_t i = 0; i < components.size() && rootInode >= 0; i++) {
+    rootInode = fileSystem->lookup(rootInode, components[i]);
+  }
+  if (rootInode < 0) {
+    cerr << "Path not found" << endl;
+    delete fileSystem;
+    delete disk;
+    return 1;
+  }
+
+  // the inode table (from the snapshot, with -s) is loaded once and
+  // shared by every walker
+  WalkState state;
+  state.disk = disk;
+  fileSystem->readSuperBlock(&state.super);
+  state.inodes = new inode_t[state.super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
+  fileSystem->readInodeRegion(&state.super, state.inodes);
+  state.busy = 0;
+  state.corrupt = false;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.changed, NULL);
+
+  // entries are named relative to the exported path's parent, like
+  // `tar -C parent name`; exporting / gives its children at the top
+  ExportEntry root;
+  root.inodeNumber = rootInode;
+  root.path = components.empty() ? "" : components.back();
+  if (state.inodes[rootInode].type == UFS_DIRECTORY) {
+    if (!root.path.empty()) {
+      root.path += "/";
+      state.found.push_back(root);
+    }
+    state.queue.push_back(root);
+  } else {
+    state.found.push_back(root);
+  }
+
+  vector<pthread_t> walkers(threads);
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&walkers[i], NULL, walkDirectories, &state);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(walkers[i], NULL);
+  }
+
+  // parents sort before their children, and the archive is the same
+  // whatever order the walkers finished in
+  sort(state.found.begin(), state.found.end(),
+       [](const ExportEntry &a, const ExportEntry &b) { return a.path < b.path; });
+
+  super_ext_t ext;
+  fileSystem->readSuperExtension(&ext);
+  inode_ext_t *inodeExts = NULL;
+  if (ext.features & UFS_FEATURE_COMPRESSION) {
+    inodeExts = new inode_ext_t[ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+    fileSystem->readInodeExtRegion(&ext, inodeExts);
+  }
+
+  bool ok = !state.corrupt;
+  char *buffer = new char[MAX_FILE_SIZE + TAR_BLOCK];
+  for (size_t i = 0; i < state.found.size() && ok; i++) {
+    ExportEntry &entry = state.found[i];
+    inode_t &inode = state.inodes[entry.inodeNumber];
+    if (inode.type == UFS_DIRECTORY) {
+      ok = writeHeader(entry.path, true, 0);
+      continue;
+    }
+
+    int size = inode.size;
+    if (inodeExts != NULL && (inodeExts[entry.inodeNumber].flags & UFS_INODE_COMPRESSED)) {
+      // compressed streams go through the decoder in LocalFileSystem
+      size = fileSystem->read(entry.inodeNumber, buffer, inode.size);
+      ok = size >= 0;
+    } else {
+      ok = size >= 0 && size <= MAX_FILE_SIZE && readFile(disk, &state.super, &inode, buffer);
+    }
+    if (!ok || !(ok = writeHeader(entry.path, false, size))) {
+      break;
+    }
+    int padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    memset(buffer + size, 0, padded - size);
+    writeAll(buffer, padded);
+  }
+
+  if (ok) {
+    // end of archive: two zero blocks
+    memset(buffer, 0, 2 * TAR_BLOCK);
+    writeAll(buffer, 2 * TAR_BLOCK);
+  } else {
+    cerr << "Error exporting " << argv[optind + 1] << endl;
+  }
+
+  delete[] buffer;
+  delete[] inodeExts;
+  delete[] state.inodes;
+  delete fileSystem;
+  delete disk;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,593 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// exit codes follow fsck(8)
+#define FSCK_OK          (0)
+#define FSCK_CORRECTED   (1)
+#define FSCK_UNCORRECTED (4)
+#define FSCK_ERROR       (8)
+
+struct Problem {
+  int phase;   // 0 super, 1 directories, 2 inodes, 3 blocks
+  int number;  // inode or block the problem is about, for ordering
+  string text;
+  bool repaired;
+};
+
+struct FsckState {
+  Disk *disk;
+  super_t super;
+  super_ext_t ext;
+  bool repair;
+
+  unsigned char *inodeBitMap;
+  unsigned char *dataBitMap;
+  inode_t *inodes;
+  inode_ext_t *inodeExts;  // NULL without UFS_FEATURE_COMPRESSION
+  unsigned int *refcounts; // NULL without a refcount region
+
+  // filled in by the directory walk
+  vector<int> parent;    // directory that links to a directory, -1 if none
+  vector<int> linkCount; // entries naming each inode, not counting . and ..
+  map<int, vector<dir_ent_t> > dirRewrites;
+
+  // work queue for the walk; `busy` counts workers holding a directory
+  deque<int> queue;
+  int busy;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  vector<Problem> problems;
+};
+
+static bool isSet(unsigned char *bitmap, int index) {
+  return (bitmap[index / 8] & (1 << (index % 8))) != 0;
+}
+
+static void setBit(unsigned char *bitmap, int index, bool value) {
+  if (value) {
+    bitmap[index / 8] |= (1 << (index % 8));
+  } else {
+    bitmap[index / 8] &= ~(1 << (index % 8));
+  }
+}
+
+// callers hold state->lock or run before/after the walk
+static void report(FsckState *state, int phase, int number, string text, bool repaired) {
+  Problem problem;
+  problem.phase = phase;
+  problem.number = number;
+  problem.text = text;
+  problem.repaired = repaired;
+  state->problems.push_back(problem);
+}
+
+static bool regionFits(int addr, int len, int lowest, int total) {
+  return len >= 0 && addr >= lowest && addr <= total - len;
+}
+
+// Superblock and extension layout. Everything after this trusts the
+// addresses, so failures here stop the check.
+static bool checkSuper(FsckState *state) {
+  super_t &s = state->super;
+  int total = state->disk->numberOfBlocks();
+  int bitsPerBlock = UFS_BLOCK_SIZE * 8;
+  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  bool ok = true;
+
+  if (s.num_inodes <= 0 || s.num_data <= 0) {
+    report(state, 0, 0, "super: no inodes or data blocks", false);
+    return false;
+  }
+  if (!regionFits(s.inode_bitmap_addr, s.inode_bitmap_len, 1, total) ||
+      (long long) s.inode_bitmap_len * bitsPerBlock < s.num_inodes) {
+    report(state, 0, 0, "super: inode bitmap does not fit", false);
+    ok = false;
+  }
+  if (!regionFits(s.data_bitmap_addr, s.data_bitmap_len, 1, total) ||
+      (long long) s.data_bitmap_len * bitsPerBlock < s.num_data) {
+    report(state, 0, 0, "super: data bitmap does not fit", false);
+    ok = false;
+  }
+  if (!regionFits(s.inode_region_addr, s.inode_region_len, 1, total) ||
+      (long long) s.inode_region_len * inodesPerBlock < s.num_inodes) {
+    report(state, 0, 0, "super: inode region does not fit", false);
+    ok = false;
+  }
+  if (!regionFits(s.data_region_addr, s.data_region_len, 1, total) || s.data_region_len < s.num_data) {
+    report(state, 0, 0, "super: data region does not fit", false);
+    ok = false;
+  }
+
+  super_ext_t &e = state->ext;
+  if ((e.features & (UFS_FEATURE_DEDUP | UFS_FEATURE_SNAPSHOT)) &&
+      (!regionFits(e.refcount_addr, e.refcount_len, 1, total) ||
+       (long long) e.refcount_len * UFS_BLOCK_SIZE < (long long) s.num_data * (long long) sizeof(unsigned int))) {
+    report(state, 0, 0, "super: refcount region does not fit", false);
+    ok = false;
+  }
+  if ((e.features & UFS_FEATURE_DEDUP) &&
+      (!regionFits(e.fingerprint_addr, e.fingerprint_len, 1, total) ||
+       (long long) e.fingerprint_len * UFS_BLOCK_SIZE < (long long) s.num_data * (long long) sizeof(unsigned long long))) {
+    report(state, 0, 0, "super: fingerprint region does not fit", false);
+    ok = false;
+  }
+  if ((e.features & UFS_FEATURE_COMPRESSION) &&
+      (!regionFits(e.inode_ext_addr, e.inode_ext_len, 1, total) ||
+       (long long) e.inode_ext_len * UFS_BLOCK_SIZE < (long long) s.num_inodes * (long long) sizeof(inode_ext_t))) {
+    report(state, 0, 0, "super: inode ext region does not fit", false);
+    ok = false;
+  }
+  if ((e.features & UFS_FEATURE_SNAPSHOT) &&
+      (e.snapshot_slots < 0 || e.snapshot_len != 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + e.inode_ext_len ||
+       !regionFits(e.snapshot_addr, e.snapshot_slots * e.snapshot_len, 1, total))) {
+    report(state, 0, 0, "super: snapshot region does not fit", false);
+    ok = false;
+  }
+  return ok;
+}
+
+static int storedBlocks(FsckState *state, int inodeNumber) {
+  inode_t &inode = state->inodes[inodeNumber];
+  int storedSize = inode.size;
+  if (state->inodeExts != NULL && (state->inodeExts[inodeNumber].flags & UFS_INODE_COMPRESSED)) {
+    storedSize = state->inodeExts[inodeNumber].stored_size;
+  }
+  if (storedSize < 0 || storedSize > MAX_FILE_SIZE) {
+    return -1;
+  }
+  return (storedSize + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+}
+
+// Read a directory's blocks, batching runs of consecutive block numbers
+// into one Disk::readBlocks call. Returns false if a pointer is bad.
+static bool readDirectory(FsckState *state, int inodeNumber, char *buffer) {
+  inode_t &inode = state->inodes[inodeNumber];
+  int blocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int lowest = state->super.data_region_addr;
+  int highest = lowest + state->super.num_data;
+
+  int i = 0;
+  while (i < blocks) {
+    int start = inode.direct[i];
+    if ((int) inode.direct[i] < lowest || (int) inode.direct[i] >= highest) {
+      return false;
+    }
+    int run = 1;
+    while (i + run < blocks && inode.direct[i + run] == (unsigned int) start + run &&
+           start + run < highest) {
+      run++;
+    }
+    state->disk->readBlocks(start, run, buffer + i * UFS_BLOCK_SIZE);
+    i += run;
+  }
+  return true;
+}
+
+static void checkDirectory(FsckState *state, int dir) {
+  inode_t &inode = state->inodes[dir];
+  if (inode.size < 0 || inode.size > MAX_FILE_SIZE) {
+    // reported with the other inode problems
+    return;
+  }
+  int blocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  vector<char> buffer(blocks * UFS_BLOCK_SIZE + 1);
+  bool readable = readDirectory(state, dir, buffer.data());
+
+  pthread_mutex_lock(&state->lock);
+  if (!readable) {
+    report(state, 1, dir, "directory " + to_string(dir) + ": block pointer outside the data region", false);
+    pthread_mutex_unlock(&state->lock);
+    return;
+  }
+
+  // a snapshot may still see these blocks, so leave shared ones alone
+  bool fix = state->repair;
+  for (int b = 0; b < blocks && state->refcounts != NULL; b++) {
+    if (state->refcounts[inode.direct[b] - state->super.data_region_addr] > 1) {
+      fix = false;
+    }
+  }
+
+  dir_ent_t *entries = (dir_ent_t *) buffer.data();
+  int count = inode.size / sizeof(dir_ent_t);
+  vector<dir_ent_t> kept;
+  bool rewrite = false;
+  for (int i = 0; i < count; i++) {
+    dir_ent_t entry = entries[i];
+    entry.name[DIR_ENT_NAME_SIZE - 1] = '\0';
+    string name = entry.name;
+    string where = "directory " + to_string(dir) + ": ";
+
+    if (name == ".") {
+      if (entry.inum != dir) {
+        report(state, 1, dir, where + "'.' points at " + to_string(entry.inum), fix);
+        entry.inum = dir;
+        rewrite = true;
+      }
+      kept.push_back(entry);
+      continue;
+    }
+    if (name == "..") {
+      int expected = dir == UFS_ROOT_DIRECTORY_INODE_NUMBER ? dir : state->parent[dir];
+      if (entry.inum != expected) {
+        report(state, 1, dir, where + "'..' points at " + to_string(entry.inum) +
+               " instead of " + to_string(expected), fix);
+        entry.inum = expected;
+        rewrite = true;
+      }
+      kept.push_back(entry);
+      continue;
+    }
+
+    if (entry.inum < 0 || entry.inum >= state->super.num_inodes || !isSet(state->inodeBitMap, entry.inum)) {
+      report(state, 1, dir, where + "entry '" + name + "' names unallocated inode " + to_string(entry.inum),
+             fix);
+      rewrite = true;
+      continue;
+    }
+
+    int child = entry.inum;
+    state->linkCount[child]++;
+    if (state->inodes[child].type == UFS_DIRECTORY) {
+      if (child == UFS_ROOT_DIRECTORY_INODE_NUMBER || state->parent[child] != -1) {
+        report(state, 1, dir, where + "entry '" + name + "' is another link to directory " +
+               to_string(child), fix);
+        state->linkCount[child]--;
+        rewrite = true;
+        continue;
+      }
+      state->parent[child] = dir;
+      state->queue.push_back(child);
+      pthread_cond_signal(&state->cond);
+    }
+    kept.push_back(entry);
+  }
+
+  if (rewrite && fix) {
+    state->dirRewrites[dir] = kept;
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+static void *walkWorker(void *arg) {
+  FsckState *state = (FsckState *) arg;
+  while (true) {
+    pthread_mutex_lock(&state->lock);
+    while (state->queue.empty() && state->busy > 0) {
+      pthread_cond_wait(&state->cond, &state->lock);
+    }
+    if (state->queue.empty()) {
+      // nothing queued and nobody left to queue more: the walk is done
+      pthread_cond_broadcast(&state->cond);
+      pthread_mutex_unlock(&state->lock);
+      return NULL;
+    }
+    int dir = state->queue.front();
+    state->queue.pop_front();
+    state->busy++;
+    pthread_mutex_unlock(&state->lock);
+
+    checkDirectory(state, dir);
+
+    pthread_mutex_lock(&state->lock);
+    state->busy--;
+    if (state->busy == 0 && state->queue.empty()) {
+      pthread_cond_broadcast(&state->cond);
+    }
+    pthread_mutex_unlock(&state->lock);
+  }
+}
+
+static void walkTree(FsckState *state, int threads) {
+  state->parent.assign(state->super.num_inodes, -1);
+  state->linkCount.assign(state->super.num_inodes, 0);
+  state->busy = 0;
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->cond, NULL);
+
+  if (!isSet(state->inodeBitMap, UFS_ROOT_DIRECTORY_INODE_NUMBER) ||
+      state->inodes[UFS_ROOT_DIRECTORY_INODE_NUMBER].type != UFS_DIRECTORY) {
+    report(state, 1, 0, "root directory is missing", false);
+    return;
+  }
+  state->parent[UFS_ROOT_DIRECTORY_INODE_NUMBER] = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  state->queue.push_back(UFS_ROOT_DIRECTORY_INODE_NUMBER);
+
+  vector<pthread_t> workers(threads);
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&workers[i], NULL, walkWorker, state);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&state->lock);
+  pthread_cond_destroy(&state->cond);
+}
+
+// Inode sanity and reachability. Returns which inodes survive a repair.
+static vector<bool> checkInodes(FsckState *state) {
+  vector<bool> keep(state->super.num_inodes, false);
+  for (int i = 0; i < state->super.num_inodes; i++) {
+    if (!isSet(state->inodeBitMap, i)) {
+      continue;
+    }
+    string where = "inode " + to_string(i) + ": ";
+    inode_t &inode = state->inodes[i];
+    keep[i] = true;
+
+    if (inode.type != UFS_DIRECTORY && inode.type != UFS_REGULAR_FILE) {
+      report(state, 2, i, where + "unknown type " + to_string(inode.type), state->repair);
+      keep[i] = false;
+      continue;
+    }
+    if (inode.size < 0 || inode.size > MAX_FILE_SIZE ||
+        (inode.type == UFS_DIRECTORY && inode.size % sizeof(dir_ent_t) != 0)) {
+      report(state, 2, i, where + "invalid size " + to_string(inode.size), false);
+    }
+
+    bool reachable = i == UFS_ROOT_DIRECTORY_INODE_NUMBER ||
+      (inode.type == UFS_DIRECTORY ? state->parent[i] != -1 : state->linkCount[i] > 0);
+    if (!reachable) {
+      report(state, 2, i, where + "not linked from any directory", state->repair);
+      keep[i] = false;
+      continue;
+    }
+
+    // truncate regular files at the first pointer outside the data region
+    int blocks = storedBlocks(state, i);
+    bool compressed = state->inodeExts != NULL && (state->inodeExts[i].flags & UFS_INODE_COMPRESSED);
+    for (int b = 0; b < blocks; b++) {
+      int relative = (int) inode.direct[b] - state->super.data_region_addr;
+      if (relative >= 0 && relative < state->super.num_data) {
+        continue;
+      }
+      bool fixable = inode.type == UFS_REGULAR_FILE && !compressed;
+      report(state, 2, i, where + "block pointer " + to_string(inode.direct[b]) + " outside the data region",
+             state->repair && fixable);
+      if (state->repair && fixable) {
+        inode.size = b * UFS_BLOCK_SIZE;
+      }
+      break;
+    }
+  }
+  return keep;
+}
+
+// Compare the bitmaps and refcounts with what inodes and snapshots use.
+static void checkBlocks(FsckState *state, vector<bool> &keep) {
+  super_t &s = state->super;
+  vector<int> references(s.num_data, 0);
+  for (int i = 0; i < s.num_inodes; i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    int blocks = storedBlocks(state, i);
+    for (int b = 0; b < blocks; b++) {
+      int relative = (int) state->inodes[i].direct[b] - s.data_region_addr;
+      if (relative >= 0 && relative < s.num_data) {
+        references[relative]++;
+      }
+    }
+  }
+
+  // each snapshot holds one reference on every block it had allocated
+  super_ext_t &e = state->ext;
+  if (e.features & UFS_FEATURE_SNAPSHOT) {
+    vector<unsigned char> header(UFS_BLOCK_SIZE);
+    vector<unsigned char> bitmap(s.data_bitmap_len * UFS_BLOCK_SIZE);
+    for (int slot = 0; slot < e.snapshot_slots; slot++) {
+      int base = e.snapshot_addr + slot * e.snapshot_len;
+      state->disk->readBlock(base, header.data());
+      if (!((snapshot_t *) header.data())->in_use) {
+        continue;
+      }
+      state->disk->readBlocks(base + 1 + s.inode_bitmap_len, s.data_bitmap_len, bitmap.data());
+      for (int j = 0; j < s.num_data; j++) {
+        if (isSet(bitmap.data(), j)) {
+          references[j]++;
+        }
+      }
+    }
+  }
+
+  for (int j = 0; j < s.num_data; j++) {
+    string where = "block " + to_string(s.data_region_addr + j) + ": ";
+    bool used = references[j] > 0;
+    if (used && !isSet(state->dataBitMap, j)) {
+      report(state, 3, j, where + "in use but marked free", state->repair);
+    } else if (!used && isSet(state->dataBitMap, j)) {
+      report(state, 3, j, where + "marked in use but unreferenced", state->repair);
+    }
+    if (state->refcounts != NULL && state->refcounts[j] != (unsigned int) references[j]) {
+      report(state, 3, j, where + "refcount " + to_string(state->refcounts[j]) + " should be " +
+             to_string(references[j]), state->repair);
+      state->refcounts[j] = references[j];
+    } else if (state->refcounts == NULL && references[j] > 1) {
+      report(state, 3, j, where + "shared by " + to_string(references[j]) + " inodes", false);
+    }
+    setBit(state->dataBitMap, j, used);
+  }
+}
+
+static void applyRepairs(FsckState *state, vector<bool> &keep) {
+  super_t &s = state->super;
+  for (int i = 0; i < s.num_inodes; i++) {
+    if (isSet(state->inodeBitMap, i) && !keep[i]) {
+      setBit(state->inodeBitMap, i, false);
+      if (state->inodeExts != NULL) {
+        memset(&state->inodeExts[i], 0, sizeof(inode_ext_t));
+      }
+    }
+  }
+
+  for (auto &rewrite : state->dirRewrites) {
+    inode_t &inode = state->inodes[rewrite.first];
+    vector<dir_ent_t> &entries = rewrite.second;
+    int oldBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int newSize = entries.size() * sizeof(dir_ent_t);
+    int newBlocks = (newSize + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+
+    vector<char> buffer(oldBlocks * UFS_BLOCK_SIZE, 0);
+    memcpy(buffer.data(), entries.data(), newSize);
+    for (int b = 0; b < newBlocks; b++) {
+      state->disk->writeBlock(inode.direct[b], buffer.data() + b * UFS_BLOCK_SIZE);
+    }
+    // blocks past the new end are released by the bitmap rebuild
+    inode.size = newSize;
+  }
+
+  // recount now that orphans and truncated tails are gone
+  vector<Problem> reported = state->problems;
+  checkBlocks(state, keep);
+  state->problems = reported;
+
+  for (int i = 0; i < s.inode_bitmap_len; i++) {
+    state->disk->writeBlock(s.inode_bitmap_addr + i, state->inodeBitMap + i * UFS_BLOCK_SIZE);
+  }
+  for (int i = 0; i < s.data_bitmap_len; i++) {
+    state->disk->writeBlock(s.data_bitmap_addr + i, state->dataBitMap + i * UFS_BLOCK_SIZE);
+  }
+  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  for (int i = 0; i < s.inode_region_len; i++) {
+    state->disk->writeBlock(s.inode_region_addr + i, state->inodes + i * inodesPerBlock);
+  }
+  if (state->refcounts != NULL) {
+    for (int i = 0; i < state->ext.refcount_len; i++) {
+      state->disk->writeBlock(state->ext.refcount_addr + i, (char *) state->refcounts + i * UFS_BLOCK_SIZE);
+    }
+  }
+  if (state->inodeExts != NULL) {
+    for (int i = 0; i < state->ext.inode_ext_len; i++) {
+      state->disk->writeBlock(state->ext.inode_ext_addr + i, (char *) state->inodeExts + i * UFS_BLOCK_SIZE);
+    }
+  }
+}
+
+static bool problemOrder(const Problem &a, const Problem &b) {
+  if (a.phase != b.phase) {
+    return a.phase < b.phase;
+  }
+  if (a.number != b.number) {
+    return a.number < b.number;
+  }
+  return a.text < b.text;
+}
+
+int main(int argc, char *argv[]) {
+  bool repair = false;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int ch;
+  while ((ch = getopt(argc, argv, "+rj:")) != -1) {
+    if (ch == 'r') {
+      repair = true;
+    } else if (ch == 'j') {
+      threads = atoi(optarg);
+    } else {
+      argc = 0;
+    }
+  }
+
+  if (argc - optind != 1 || threads < 1) {
+    cerr << argv[0] << ": [-r] [-j threads] diskImageFile" << endl;
+    cerr << "  -r  repair the problems that can be fixed" << endl;
+    return FSCK_ERROR;
+  }
+
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+
+  FsckState state;
+  state.disk = disk;
+  state.repair = repair;
+  fileSystem->readSuperBlock(&state.super);
+  fileSystem->readSuperExtension(&state.ext);
+
+  if (!checkSuper(&state)) {
+    for (const auto &problem : state.problems) {
+      cout << problem.text << endl;
+    }
+    cout << "superblock is unusable, not checking further" << endl;
+    delete fileSystem;
+    delete disk;
+    return FSCK_UNCORRECTED;
+  }
+
+  // pull every metadata region in with one read each
+  super_t &s = state.super;
+  state.inodeBitMap = new unsigned char[s.inode_bitmap_len * UFS_BLOCK_SIZE];
+  disk->readBlocks(s.inode_bitmap_addr, s.inode_bitmap_len, state.inodeBitMap);
+  state.dataBitMap = new unsigned char[s.data_bitmap_len * UFS_BLOCK_SIZE];
+  disk->readBlocks(s.data_bitmap_addr, s.data_bitmap_len, state.dataBitMap);
+  state.inodes = new inode_t[s.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
+  disk->readBlocks(s.inode_region_addr, s.inode_region_len, state.inodes);
+
+  state.inodeExts = NULL;
+  if (state.ext.features & UFS_FEATURE_COMPRESSION) {
+    state.inodeExts = new inode_ext_t[state.ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+    disk->readBlocks(state.ext.inode_ext_addr, state.ext.inode_ext_len, state.inodeExts);
+  }
+  state.refcounts = NULL;
+  if (state.ext.refcount_len > 0) {
+    state.refcounts = new unsigned int[state.ext.refcount_len * UFS_BLOCK_SIZE / sizeof(unsigned int)];
+    disk->readBlocks(state.ext.refcount_addr, state.ext.refcount_len, state.refcounts);
+  }
+
+  walkTree(&state, threads);
+  vector<bool> keep = checkInodes(&state);
+  checkBlocks(&state, keep);
+
+  int unrepaired = 0;
+  for (const auto &problem : state.problems) {
+    if (!problem.repaired) {
+      unrepaired++;
+    }
+  }
+
+  if (repair && state.problems.size() > 0) {
+    disk->beginTransaction();
+    applyRepairs(&state, keep);
+    disk->commit();
+  }
+
+  sort(state.problems.begin(), state.problems.end(), problemOrder);
+  for (const auto &problem : state.problems) {
+    cout << problem.text << (problem.repaired ? " (repaired)" : "") << endl;
+  }
+
+  int status = FSCK_OK;
+  if (unrepaired > 0) {
+    cout << state.problems.size() << " problems found, " << unrepaired << " not repaired" << endl;
+    status = FSCK_UNCORRECTED;
+  } else if (state.problems.size() > 0) {
+    cout << state.problems.size() << " problems found and repaired" << endl;
+    status = FSCK_CORRECTED;
+  } else {
+    cout << "clean" << endl;
+  }
+
+  delete[] state.inodeBitMap;
+  delete[] state.dataBitMap;
+  delete[] state.inodes;
+  delete[] state.inodeExts;
+  delete[] state.refcounts;
+  delete fileSystem;
+  delete disk;
+  return status;
+}
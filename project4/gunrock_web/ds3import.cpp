@@ -0,0 +1,264 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// files per LocalFileSystem::batch call
+#define FILES_PER_BATCH (128)
+// how far the readers may run ahead of the writer, in files
+#define READ_AHEAD_FILES (4 * FILES_PER_BATCH)
+
+struct ImportEntry {
+  string hostPath;
+  string name;
+  int parent;       // index of the parent entry, -1 for the import root
+  int depth;
+  bool isDirectory;
+  int inodeNumber;  // set once created
+  string contents;  // regular files, filled in by a reader
+  bool loaded;
+  bool failed;
+};
+
+struct ImportState {
+  vector<ImportEntry> entries;
+  vector<int> files;     // indices into entries, in writer order
+  size_t nextToRead;     // next slot in `files` a reader will claim
+  size_t nextToWrite;    // first slot in `files` the writer still needs
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+// Collect the tree under hostPath, parents before children, names sorted
+// so images built from the same tree come out the same.
+static bool walk(ImportState *state, string hostPath, int parent, int depth) {
+  DIR *dir = opendir(hostPath.c_str());
+  if (dir == NULL) {
+    cerr << "Could not open " << hostPath << endl;
+    return false;
+  }
+  vector<string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string name = entry->d_name;
+    if (name != "." && name != "..") {
+      names.push_back(name);
+    }
+  }
+  closedir(dir);
+  sort(names.begin(), names.end());
+
+  for (size_t i = 0; i < names.size(); i++) {
+    string path = hostPath + "/" + names[i];
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+      // sockets, devices and symlinks have no ufs equivalent
+      continue;
+    }
+    if (names[i].length() >= DIR_ENT_NAME_SIZE) {
+      cerr << "Name too long: " << path << endl;
+      return false;
+    }
+
+    ImportEntry importEntry;
+    importEntry.hostPath = path;
+    importEntry.name = names[i];
+    importEntry.parent = parent;
+    importEntry.depth = depth;
+    importEntry.isDirectory = S_ISDIR(st.st_mode);
+    importEntry.inodeNumber = -1;
+    importEntry.loaded = false;
+    importEntry.failed = false;
+    state->entries.push_back(importEntry);
+
+    if (importEntry.isDirectory && !walk(state, path, state->entries.size() - 1, depth + 1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reader threads: load file contents in writer order, staying at most
+// READ_AHEAD_FILES ahead so memory use stays bounded.
+static void *readFiles(void *arg) {
+  ImportState *state = (ImportState *) arg;
+  char *buffer = new char[MAX_FILE_SIZE];
+
+  pthread_mutex_lock(&state->lock);
+  while (state->nextToRead < state->files.size()) {
+    if (state->nextToRead >= state->nextToWrite + READ_AHEAD_FILES) {
+      pthread_cond_wait(&state->changed, &state->lock);
+      continue;
+    }
+    ImportEntry &entry = state->entries[state->files[state->nextToRead++]];
+    pthread_mutex_unlock(&state->lock);
+
+    // anything past MAX_FILE_SIZE would not fit in the inode anyway
+    string contents;
+    bool failed = true;
+    int fd = open(entry.hostPath.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      ssize_t total = 0;
+      ssize_t ret = 0;
+      while (total < MAX_FILE_SIZE && (ret = read(fd, buffer + total, MAX_FILE_SIZE - total)) > 0) {
+        total += ret;
+      }
+      failed = ret < 0;
+      contents.assign(buffer, total);
+      close(fd);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    entry.contents.swap(contents);
+    entry.failed = failed;
+    entry.loaded = true;
+    pthread_cond_broadcast(&state->changed);
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  delete[] buffer;
+  return NULL;
+}
+
+static int parentInode(ImportState *state, ImportEntry &entry, int rootInode) {
+  return entry.parent < 0 ? rootInode : state->entries[entry.parent].inodeNumber;
+}
+
+static void usage(char *program) {
+  cerr << program << ": [-j threads] diskImageFile hostDirectory [parentInode]" << endl;
+  cerr << "For example:" << endl;
+  cerr << "    $ " << program << " -j 8 tests/disk_images/a.img static 0" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  int threads = 4;
+  int ch;
+  while ((ch = getopt(argc, argv, "+j:")) != -1) {
+    if (ch == 'j' && atoi(optarg) > 0) {
+      threads = atoi(optarg);
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc - optind != 2 && argc - optind != 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  string hostRoot = argv[optind + 1];
+  int rootInode = argc - optind == 3 ? stoi(argv[optind + 2]) : UFS_ROOT_DIRECTORY_INODE_NUMBER;
+
+  ImportState state;
+  state.nextToRead = 0;
+  state.nextToWrite = 0;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.changed, NULL);
+  if (!walk(&state, hostRoot, -1, 0)) {
+    return 1;
+  }
+  for (size_t i = 0; i < state.entries.size(); i++) {
+    if (!state.entries[i].isDirectory) {
+      state.files.push_back(i);
+    }
+  }
+
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+
+  vector<pthread_t> readers(threads);
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&readers[i], NULL, readFiles, &state);
+  }
+
+  // Directories first, one batch per level: a level's parents all exist
+  // once the batch before it has run.
+  bool ok = true;
+  for (int depth = 0; ok; depth++) {
+    vector<BatchOp> ops;
+    vector<int> created;
+    for (size_t i = 0; i < state.entries.size(); i++) {
+      ImportEntry &entry = state.entries[i];
+      if (entry.isDirectory && entry.depth == depth) {
+        BatchOp op = {BATCH_CREATE, parentInode(&state, entry, rootInode), UFS_DIRECTORY, entry.name, NULL, 0, 0};
+        ops.push_back(op);
+        created.push_back(i);
+      }
+    }
+    if (ops.empty()) {
+      break;
+    }
+    if (fileSystem->batch(ops) < 0) {
+      ok = false;
+      break;
+    }
+    for (size_t i = 0; i < created.size(); i++) {
+      state.entries[created[i]].inodeNumber = ops[i].result;
+    }
+  }
+
+  // Then files, in batches of create + write pairs, as the readers
+  // deliver them
+  while (ok && state.nextToWrite < state.files.size()) {
+    size_t end = min(state.files.size(), state.nextToWrite + FILES_PER_BATCH);
+    vector<BatchOp> ops;
+    pthread_mutex_lock(&state.lock);
+    for (size_t f = state.nextToWrite; f < end; f++) {
+      ImportEntry &entry = state.entries[state.files[f]];
+      while (!entry.loaded) {
+        pthread_cond_wait(&state.changed, &state.lock);
+      }
+      if (entry.failed) {
+        cerr << "Could not read " << entry.hostPath << endl;
+        ok = false;
+        break;
+      }
+      BatchOp create = {BATCH_CREATE, parentInode(&state, entry, rootInode), UFS_REGULAR_FILE, entry.name, NULL, 0, 0};
+      BatchOp write = {BATCH_WRITE, BATCH_PREVIOUS, 0, "", entry.contents.data(), (int) entry.contents.size(), 0};
+      ops.push_back(create);
+      ops.push_back(write);
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    if (ok && fileSystem->batch(ops) < 0) {
+      ok = false;
+    }
+
+    pthread_mutex_lock(&state.lock);
+    for (size_t f = state.nextToWrite; f < end; f++) {
+      string().swap(state.entries[state.files[f]].contents);
+    }
+    state.nextToWrite = end;
+    pthread_cond_broadcast(&state.changed);
+    pthread_mutex_unlock(&state.lock);
+  }
+
+  // after an error, stop the readers from claiming anything new
+  pthread_mutex_lock(&state.lock);
+  state.nextToRead = state.files.size();
+  pthread_cond_broadcast(&state.changed);
+  pthread_mutex_unlock(&state.lock);
+  for (int i = 0; i < threads; i++) {
+    pthread_join(readers[i], NULL);
+  }
+
+  delete fileSystem;
+  delete disk;
+  if (!ok) {
+    cerr << "Error importing " << hostRoot << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,8 +1,13 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "StringUtils.h"
 #include "LocalFileSystem.h"
@@ -16,22 +21,225 @@ bool compareByName(const dir_ent_t& a, const dir_ent_t& b) {
     return std::strcmp(a.name, b.name) < 0;
 }
 
+// One directory's entries, sorted by name
+struct Listing {
+    string path;
+    int inodeNumber;
+    vector<dir_ent_t> entries;
+};
+
+// Shared state of a listing. The inode table is read once up front, so
+// stats come from memory and workers only read directory blocks.
+struct ListState {
+    Disk *disk;
+    super_t super;
+    inode_t *inodes;
+    inode_ext_t *inodeExts;
+    bool recursive;
+    deque<Listing> queue;
+    int busy;
+    vector<Listing> listings;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static bool validInode(ListState *state, int inodeNumber) {
+    return inodeNumber >= 0 && inodeNumber < state->super.num_inodes;
+}
+
+static string childPath(const string &parent, const string &name) {
+    return parent == "/" ? parent + name : parent + "/" + name;
+}
+
+static void readDirectory(ListState *state, Listing *listing) {
+    inode_t &inode = state->inodes[listing->inodeNumber];
+    int blocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    if (blocks > DIRECT_PTRS) {
+        return;
+    }
+    vector<char> buffer((size_t) max(blocks, 1) * UFS_BLOCK_SIZE);
+    for (int i = 0; i < blocks; i++) {
+        int block = inode.direct[i];
+        if (block < state->super.data_region_addr || block >= state->super.data_region_addr + state->super.num_data) {
+            return;
+        }
+        state->disk->readBlock(block, &buffer[(size_t) i * UFS_BLOCK_SIZE]);
+    }
+
+    dir_ent_t *entries = (dir_ent_t *) &buffer[0];
+    int numEntries = inode.size / sizeof(dir_ent_t);
+    for (int i = 0; i < numEntries; i++) {
+        entries[i].name[DIR_ENT_NAME_SIZE - 1] = '\0';
+        listing->entries.push_back(entries[i]);
+    }
+    sort(listing->entries.begin(), listing->entries.end(), compareByName);
+}
+
+static void *listDirectories(void *arg) {
+    ListState *state = (ListState *) arg;
+
+    pthread_mutex_lock(&state->lock);
+    while (true) {
+        if (state->queue.empty()) {
+            if (state->busy == 0) {
+                break;
+            }
+            pthread_cond_wait(&state->changed, &state->lock);
+            continue;
+        }
+        Listing listing = state->queue.front();
+        state->queue.pop_front();
+        state->busy++;
+        pthread_mutex_unlock(&state->lock);
+
+        readDirectory(state, &listing);
+        vector<Listing> subdirectories;
+        for (size_t i = 0; state->recursive && i < listing.entries.size(); i++) {
+            dir_ent_t &entry = listing.entries[i];
+            if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0 ||
+                !validInode(state, entry.inum) || state->inodes[entry.inum].type != UFS_DIRECTORY) {
+                continue;
+            }
+            Listing subdirectory;
+            subdirectory.path = childPath(listing.path, entry.name);
+            subdirectory.inodeNumber = entry.inum;
+            subdirectories.push_back(subdirectory);
+        }
+
+        pthread_mutex_lock(&state->lock);
+        state->listings.push_back(listing);
+        state->queue.insert(state->queue.end(), subdirectories.begin(), subdirectories.end());
+        state->busy--;
+        pthread_cond_broadcast(&state->changed);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Type, size and block count of an inode, from the in-memory tables.
+// Returns false for inode numbers outside the table.
+static bool statEntry(ListState *state, int inodeNumber, string *type, int *size, int *blocks) {
+    if (!validInode(state, inodeNumber)) {
+        return false;
+    }
+    inode_t &inode = state->inodes[inodeNumber];
+    *type = inode.type == UFS_DIRECTORY ? "directory" : "file";
+    *size = inode.size;
+    int storedSize = inode.size;
+    if (state->inodeExts != NULL && (state->inodeExts[inodeNumber].flags & UFS_INODE_COMPRESSED)) {
+        storedSize = state->inodeExts[inodeNumber].stored_size;
+    }
+    *blocks = (storedSize + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    return true;
+}
+
+static string jsonString(const string &value) {
+    string out = "\"";
+    for (size_t i = 0; i < value.length(); i++) {
+        unsigned char c = value[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+enum { FORMAT_TEXT, FORMAT_TSV, FORMAT_JSON };
+
+// One record of -o tsv / -o json output. TSV columns are path, inode,
+// type, size and blocks.
+static void printRecord(ListState *state, int format, bool *first, const string &path, int inodeNumber) {
+    string type = "unknown";
+    int size = -1;
+    int blocks = -1;
+    statEntry(state, inodeNumber, &type, &size, &blocks);
+    if (format == FORMAT_TSV) {
+        cout << path << "\t" << inodeNumber << "\t" << type << "\t" << size << "\t" << blocks << "\n";
+    } else {
+        cout << (*first ? "[\n  " : ",\n  ") << "{\"path\": " << jsonString(path) << ", \"inode\": " << inodeNumber
+             << ", \"type\": \"" << type << "\", \"size\": " << size << ", \"blocks\": " << blocks << "}";
+    }
+    *first = false;
+}
+
+// One line of text output: "inum<TAB>name", with type, size and blocks
+// in between for -l
+static void printLine(ListState *state, bool longFormat, int inodeNumber, const string &name) {
+    cout << inodeNumber << "\t";
+    if (longFormat) {
+        string type;
+        int size;
+        int blocks;
+        if (statEntry(state, inodeNumber, &type, &size, &blocks)) {
+            cout << type << "\t" << size << "\t" << blocks << "\t";
+        } else {
+            cout << "?\t?\t?\t";
+        }
+    }
+    cout << name << "\n";
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        cerr << argv[0] << ": diskImageFile directory" << endl;
+    // -s lists the directory as it was in a snapshot, -R lists every
+    // directory below it too, across -j worker threads, -l adds type, size
+    // and block count, and -o tsv|json prints one record per entry (with
+    // full paths, without . and ..) for scripts
+    string snapshot;
+    bool recursive = false;
+    bool longFormat = false;
+    int format = FORMAT_TEXT;
+    int threads = 4;
+    int ch;
+    while ((ch = getopt(argc, argv, "+s:Rlo:j:")) != -1) {
+        if (ch == 's') {
+            snapshot = optarg;
+        } else if (ch == 'R') {
+            recursive = true;
+        } else if (ch == 'l') {
+            longFormat = true;
+        } else if (ch == 'o' && string(optarg) == "tsv") {
+            format = FORMAT_TSV;
+        } else if (ch == 'o' && string(optarg) == "json") {
+            format = FORMAT_JSON;
+        } else if (ch == 'j' && atoi(optarg) > 0) {
+            threads = atoi(optarg);
+        } else {
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 2) {
+        cerr << argv[0] << ": [-s snapshot] [-R] [-l] [-o tsv|json] [-j threads] diskImageFile directory" << endl;
         cerr << "For example:" << endl;
         cerr << "    $ " << argv[0] << " tests/disk_images/a.img /a/b" << endl;
+        cerr << "    $ " << argv[0] << " -R -o json tests/disk_images/a.img /" << endl;
         return 1;
     }
     //./ds3ls tests/disk_images/a.img /
     // #define UFS_ROOT_DIRECTORY_INODE_NUMBER (0)
     // parse command line arguments
     // for debug: gdbserver localhost:1234 ./ds3ls tests/disk_images/a.img /
-    Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+    // snapshots don't change under us, so reading one needs no lock
+    Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE, snapshot.empty());
     LocalFileSystem *fileSystem = new LocalFileSystem(disk);
-    string directory = string(argv[2]);
-    
+    string directory = string(argv[optind + 1]);
+
+    if (!snapshot.empty() && fileSystem->openSnapshot(snapshot) < 0) {
+        cerr << "Directory not found" << endl;
+        delete fileSystem;
+        delete disk;
+        return 1;
+    }
+
     int currentInodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+    string resolvedPath = "/";
 
     size_t pos = 0;
     string delimiter = "/";
@@ -47,6 +255,7 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
             currentInodeNumber = nextInode;
+            resolvedPath = childPath(resolvedPath, component);
         }
     }
 
@@ -59,50 +268,84 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         currentInodeNumber = nextInode;
+        resolvedPath = childPath(resolvedPath, directory);
     }
 
   inode_t inode;
-  if (fileSystem->stat(currentInodeNumber, &inode) < 0) {
+  if (fileSystem->stat(currentInodeNumber, &inode) < 0 ||
+      (inode.type != UFS_DIRECTORY && inode.type != UFS_REGULAR_FILE)) {
     cerr << "Directory not found" << endl;
     delete fileSystem;
     delete disk;
     return 1;
   }
 
-  if (inode.type == UFS_DIRECTORY) {
-        char buffer[inode.size];
-        if (fileSystem->read(currentInodeNumber, buffer, UFS_BLOCK_SIZE) < 0) {
-            cerr << "Directory not found" << endl;
-            delete fileSystem;
-            delete disk;
-            return 1;
-        }
+    ListState state;
+    state.disk = disk;
+    fileSystem->readSuperBlock(&state.super);
+    state.inodes = new inode_t[state.super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t)];
+    fileSystem->readInodeRegion(&state.super, state.inodes);
+    state.inodeExts = NULL;
+    super_ext_t ext;
+    fileSystem->readSuperExtension(&ext);
+    if (ext.features & UFS_FEATURE_COMPRESSION) {
+        state.inodeExts = new inode_ext_t[ext.inode_ext_len * UFS_BLOCK_SIZE / sizeof(inode_ext_t)];
+        fileSystem->readInodeExtRegion(&ext, state.inodeExts);
+    }
+    state.recursive = recursive;
+    state.busy = 0;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.changed, NULL);
 
-        vector<dir_ent_t> entries;
-        int numEntries = inode.size / sizeof(dir_ent_t);
+    bool first = true;
+    if (inode.type == UFS_REGULAR_FILE) {
+        if (format == FORMAT_TEXT) {
+            printLine(&state, longFormat, currentInodeNumber, directory);
+        } else {
+            printRecord(&state, format, &first, resolvedPath, currentInodeNumber);
+        }
+    } else {
+        Listing root;
+        root.path = resolvedPath;
+        root.inodeNumber = currentInodeNumber;
+        state.queue.push_back(root);
 
-        for (int i = 0; i < numEntries; i++) {
-            dir_ent_t *entry = (dir_ent_t *)(buffer + i * sizeof(dir_ent_t));
-            //if (entry->inum != 0) {  // Valid entries
-            entries.push_back(*entry);
-            //}
+        int workers = recursive ? threads : 1;
+        vector<pthread_t> walkers(workers);
+        for (int i = 0; i < workers; i++) {
+            pthread_create(&walkers[i], NULL, listDirectories, &state);
+        }
+        for (int i = 0; i < workers; i++) {
+            pthread_join(walkers[i], NULL);
         }
 
-        sort(entries.begin(), entries.end(), compareByName);
+        // the output doesn't depend on which worker got there first
+        sort(state.listings.begin(), state.listings.end(),
+             [](const Listing &a, const Listing &b) { return a.path < b.path; });
 
-        for (const auto &entry : entries) {
-            cout << entry.inum << "\t" << entry.name << endl;
+        for (size_t l = 0; l < state.listings.size(); l++) {
+            Listing &listing = state.listings[l];
+            if (format == FORMAT_TEXT && recursive) {
+                cout << (l > 0 ? "\n" : "") << listing.path << ":\n";
+            }
+            for (const auto &entry : listing.entries) {
+                if (format == FORMAT_TEXT) {
+                    printLine(&state, longFormat, entry.inum, entry.name);
+                } else if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0) {
+                    printRecord(&state, format, &first, childPath(listing.path, entry.name), entry.inum);
+                }
+            }
         }
-    } else if (inode.type == UFS_REGULAR_FILE) {
-        cout << currentInodeNumber << "\t" << directory << endl;
-    } else {
-        cerr << "Directory not found" << endl;
-        delete fileSystem;
-        delete disk;
-        return 1;
     }
 
+    if (format == FORMAT_JSON) {
+        cout << (first ? "[]\n" : "\n]\n");
+    }
+    cout.flush();
+
     // Cleanup
+    delete[] state.inodeExts;
+    delete[] state.inodes;
     delete fileSystem;
     delete disk;
 
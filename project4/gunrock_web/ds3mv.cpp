@@ -0,0 +1,39 @@
+#include <iostream>
+#include <string>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  if (argc != 6) {
+    cerr << argv[0] << ": diskImageFile srcParentInode srcName dstParentInode dstName" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " tests/disk_images/a.img 0 a 0 renamed" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  int srcParent = stoi(argv[2]);
+  string srcName = string(argv[3]);
+  int dstParent = stoi(argv[4]);
+  string dstName = string(argv[5]);
+
+  // replacing an existing entry unlinks it first, keep that atomic
+  disk->beginTransaction();
+  if (fileSystem->rename(srcParent, srcName, dstParent, dstName) < 0) {
+    disk->rollback();
+    cerr << "Error moving entry" << endl;
+    delete fileSystem;
+    delete disk;
+    return 1;
+  }
+  disk->commit();
+
+  delete fileSystem;
+  delete disk;
+  return 0;
+}
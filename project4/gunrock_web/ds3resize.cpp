@@ -0,0 +1,37 @@
+#include <iostream>
+#include <string>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    cerr << argv[0] << ": diskImageFile numInodes numDataBlocks" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " tests/disk_images/a.img 256 1024" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  int numInodes = stoi(argv[2]);
+  int numData = stoi(argv[3]);
+
+  // regions move around, so either all of it lands or none of it does
+  disk->beginTransaction();
+  if (fileSystem->grow(numInodes, numData) < 0) {
+    disk->rollback();
+    cerr << "Error resizing file system" << endl;
+    delete fileSystem;
+    delete disk;
+    return 1;
+  }
+  disk->commit();
+
+  delete fileSystem;
+  delete disk;
+  return 0;
+}
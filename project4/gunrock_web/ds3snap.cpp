@@ -0,0 +1,73 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+void usage(char *program) {
+  cerr << program << ": diskImageFile list" << endl;
+  cerr << program << ": diskImageFile create|delete snapshotName" << endl;
+  cerr << "For example:" << endl;
+  cerr << "    $ " << program << " snap.img create nightly" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  string command = string(argv[2]);
+  if ((command == "list" && argc != 3) ||
+      ((command == "create" || command == "delete") && argc != 4) ||
+      (command != "list" && command != "create" && command != "delete")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+
+  if (command == "list") {
+    vector<snapshot_t> snapshots;
+    if (fileSystem->listSnapshots(&snapshots) < 0) {
+      cerr << "Error listing snapshots" << endl;
+      delete fileSystem;
+      delete disk;
+      return 1;
+    }
+    for (const auto &snapshot : snapshots) {
+      cout << snapshot.name << endl;
+    }
+    delete fileSystem;
+    delete disk;
+    return 0;
+  }
+
+  // both commands touch several regions, so keep them all-or-nothing
+  string name = string(argv[3]);
+  disk->beginTransaction();
+  int ret;
+  if (command == "create") {
+    ret = fileSystem->createSnapshot(name);
+  } else {
+    ret = fileSystem->deleteSnapshot(name);
+  }
+
+  if (ret < 0) {
+    disk->rollback();
+    cerr << "Error " << (command == "create" ? "creating" : "deleting") << " snapshot" << endl;
+    delete fileSystem;
+    delete disk;
+    return 1;
+  }
+
+  disk->commit();
+  delete fileSystem;
+  delete disk;
+  return 0;
+}
@@ -2,7 +2,15 @@
 #include <unistd.h>
 #include <assert.h>
 #include <signal.h>
+#include <sched.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 
 #include <iostream>
 #include <memory>
@@ -10,6 +18,8 @@
 #include <vector>
 #include <sstream>
 #include <deque>
+#include <unordered_map>
+#include <time.h>
 
 #include "ClientError.h"
 #include "HTTPRequest.h"
@@ -20,6 +30,7 @@
 #include "DistributedFileSystemService.h"
 #include "MySocket.h"
 #include "MyServerSocket.h"
+#include "RequestScheduler.h"
 #include "dthread.h"
 
 using namespace std;
@@ -30,13 +41,80 @@ string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 string DISKFILE = "disk.img";
+int MAX_KEEPALIVE_REQUESTS = 100;
+int IDLE_TIMEOUT = 5;
+int ACCEPTORS = 1;
+int BACKLOG = SOMAXCONN;
+int CACHE_MEGABYTES = 16;
 
 vector<HttpService *> services;
+FileService *file_service;
 
-HttpService *find_service(HTTPRequest *request) {
+// set by SIGUSR1, the first shard prints cache counters when it sees it
+volatile sig_atomic_t stats_requested = 0;
+
+void request_stats(int signal) {
+  stats_requested = 1;
+}
+
+void print_cache_stats() {
+  FileCache *cache = file_service->getCache();
+  if (cache == NULL) {
+    cout << "file cache: off" << endl;
+    return;
+  }
+  FileCacheStats stats = cache->stats();
+  unsigned long long lookups = stats.hits + stats.misses;
+  cout << "file cache: hits " << stats.hits << " misses " << stats.misses << " (stale " << stats.stale
+       << ") hit rate " << (lookups > 0 ? 100 * stats.hits / lookups : 0) << "% evictions " << stats.evictions
+       << " entries " << stats.entries << " bytes " << stats.bytes << endl;
+}
+
+// A connection the event loop owns; see below
+struct Connection;
+
+// Workers hand connections back to the event loop once the response is
+// written: to be closed, or kept open for the client's next request.
+struct ReturnedConnection {
+  int fd;
+  bool keepAlive;
+};
+
+// One listening socket with its own event loop, request buffer and
+// workers. With -a N there are N of these on SO_REUSEPORT sockets, so
+// the kernel spreads new connections across them and nothing but the
+// services is shared between shards.
+struct Shard {
+  int index;
+  MyServerSocket *server;
+  // CPU the loop and workers are pinned to, -1 for none
+  int cpu;
+
+  // Complete requests wait here for a worker, in the order SCHEDALG
+  // picks. It holds at most BUFFER_SIZE so a burst can't grow it
+  // unbounded; past that, connections wait in `parked`.
+  RequestScheduler *requestBuffer;
+  unsigned long long requestSequence;
+  pthread_mutex_t bufferLock;
+  pthread_cond_t bufferNotEmpty;
+
+  // Writing to returnedEvent wakes the loop up to collect these, and to
+  // retry parked connections once a worker has made room in the buffer
+  deque<ReturnedConnection> returnedConnections;
+  pthread_mutex_t returnedLock;
+  int returnedEvent;
+
+  int epollFd;
+  unordered_map<int, Connection *> connections;
+  // connections with a complete request that didn't fit in the buffer,
+  // oldest first; they are out of epoll until it goes in
+  deque<int> parked;
+};
+
+HttpService *find_service(string path) {
    // find a service that is registered for this path prefix
   for (unsigned int idx = 0; idx < services.size(); idx++) {
-    if (request->getPath().find(services[idx]->pathPrefix()) == 0) {
+    if (path.find(services[idx]->pathPrefix()) == 0) {
       return services[idx];
     }
   }
@@ -44,8 +122,13 @@ HttpService *find_service(HTTPRequest *request) {
   return NULL;
 }
 
+HttpService *find_service(HTTPRequest *request) {
+  return find_service(request->getPath());
+}
 
-void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
+
+// Returns false if the service threw instead of finishing its response
+bool invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
   stringstream payload;
 
   try {
@@ -71,55 +154,440 @@ void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPRespo
     }
   } catch (ClientError &ce) {
     response->setStatus(ce.status_code);
+    return false;
   } catch (...) {
     // reset the response object and return an error
     response->setBody("");
     response->setStatus(500);
+    return false;
   }
+  return true;
 }
 
-void handle_request(MySocket *client) {
-  HTTPRequest *request = new HTTPRequest(client, PORT);
+// Serves one request and returns whether the connection can take another
+bool handle_request(MySocket *client, HTTPRequest *request, bool keepAlive) {
   HTTPResponse *response = new HTTPResponse();
   stringstream payload;
-  
-  // read in the request
-  bool readResult = false;
-  try {
-    payload << "client: " << (void *) client;
-    sync_print("read_request_enter", payload.str());
-    readResult = request->readRequest();
-    sync_print("read_request_return", payload.str());
-  } catch (...) {
-    // swallow it
-  }    
-    
-  if (!readResult) {
-    // there was a problem reading in the request, bail
-    delete response;
-    delete request;
-    sync_print("read_request_error", payload.str());
-    return;
-  }
-  
+
+  // set up front, a streaming service sends the headers itself
+  response->setClient(client);
+  response->setHeader("Connection", keepAlive ? "keep-alive" : "close");
   HttpService *service = find_service(request);
-  invoke_service_method(service, request, response);
+  bool completed = invoke_service_method(service, request, response);
 
   // send data back to the client and clean up
   payload.str(""); payload.clear();
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
   cout << payload.str() << endl;
-  client->write(response->response());
-    
+  bool written = true;
+  try {
+    if (response->headersSent() && !completed) {
+      // the service failed partway through a stream, the status line is
+      // long gone; closing without the last chunk tells the client the
+      // body is incomplete
+      written = false;
+    } else if (response->isStreaming()) {
+      response->endStream();
+    } else {
+      client->write(response->response());
+    }
+    if (response->getBodyFile() >= 0 && !request->isHead()) {
+      client->sendFile(response->getBodyFile(), response->getBodyFileOffset(), response->getBodyFileLength());
+    }
+  } catch (...) {
+    // the client went away, nothing left to tell it
+    written = false;
+  }
+
   delete response;
   delete request;
+  return written && keepAlive;
+}
 
-  payload.str(""); payload.clear();
-  payload << " client: " << (void *) client;
+void wake_event_loop(Shard *shard) {
+  uint64_t one = 1;
+  if (write(shard->returnedEvent, &one, sizeof(one)) < 0) {
+    // the counter is already nonzero, so the loop will wake up anyway
+  }
+}
+
+void *worker(void *arg) {
+  Shard *shard = (Shard *) arg;
+  while (true) {
+    dthread_mutex_lock(&shard->bufferLock);
+    while (shard->requestBuffer->size() == 0) {
+      dthread_cond_wait(&shard->bufferNotEmpty, &shard->bufferLock);
+    }
+    // the loop may have parked connections since the buffer filled up
+    bool wasFull = (int) shard->requestBuffer->size() >= BUFFER_SIZE;
+    QueuedRequest queued = shard->requestBuffer->take();
+    dthread_mutex_unlock(&shard->bufferLock);
+    if (wasFull) {
+      wake_event_loop(shard);
+    }
+
+    ReturnedConnection returned;
+    returned.fd = queued.client->getFd();
+    returned.keepAlive = handle_request(queued.client, queued.request, queued.keepAlive);
+    dthread_mutex_lock(&shard->returnedLock);
+    shard->returnedConnections.push_back(returned);
+    dthread_mutex_unlock(&shard->returnedLock);
+    wake_event_loop(shard);
+  }
+  return NULL;
+}
+
+long long monotonic_milliseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Expected response size for smallest-file-first, from sizeHint(), which
+// doesn't block. Anything we can't size (not a GET, not found, not seen
+// yet) costs 0.
+long long request_cost(HTTPRequest *request) {
+  if (!request->isGet()) {
+    return 0;
+  }
+  HttpService *service = find_service(request);
+  long long size = service == NULL ? -1 : service->sizeHint(request->getPath());
+  return size < 0 ? 0 : size;
+}
+
+// the peer's address, without the port: one client, many connections
+string client_key(MySocket *client) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  char text[INET6_ADDRSTRLEN] = "";
+  if (getpeername(client->getFd(), (struct sockaddr *) &address, &length) == 0) {
+    if (address.ss_family == AF_INET) {
+      inet_ntop(AF_INET, &((struct sockaddr_in *) &address)->sin_addr, text, sizeof(text));
+    } else if (address.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &address)->sin6_addr, text, sizeof(text));
+    }
+  }
+  return text;
+}
+
+// Hand a complete request to the workers. Returns false, and the request
+// stays the caller's, when the buffer already holds BUFFER_SIZE: the
+// event loop must never wait for a worker.
+bool enqueue_request(Shard *shard, MySocket *client, HTTPRequest *request, bool keepAlive) {
+  QueuedRequest queued;
+  queued.client = client;
+  queued.request = request;
+  queued.keepAlive = keepAlive;
+  queued.cost = shard->requestBuffer->needsCost() ? request_cost(request) : 0;
+  queued.arrivalMs = monotonic_milliseconds();
+  if (shard->requestBuffer->needsClientKey()) {
+    queued.clientKey = client_key(client);
+  }
+
+  dthread_mutex_lock(&shard->bufferLock);
+  if ((int) shard->requestBuffer->size() >= BUFFER_SIZE) {
+    dthread_mutex_unlock(&shard->bufferLock);
+    return false;
+  }
+  queued.sequence = shard->requestSequence++;
+  shard->requestBuffer->put(queued);
+  dthread_cond_signal(&shard->bufferNotEmpty);
+  dthread_mutex_unlock(&shard->bufferLock);
+  return true;
+}
+
+// epoll events handled per wakeup, and bytes read per readable event
+#define MAX_EVENTS (256)
+#define READ_CHUNK_SIZE (16384)
+
+// A client connection, from accept until it is closed. While a worker
+// has its request the socket is out of epoll and only the worker uses
+// `client`; everything else belongs to the event loop.
+struct Connection {
+  MySocket *client;
+  // the request being read, NULL while a worker has it
+  HTTPRequest *request;
+  // bytes read past the end of the last request (pipelining)
+  string buffered;
+  // requests dispatched so far
+  int served;
+  // when the loop last heard from or handed the connection back
+  time_t lastActive;
+  // `request` is complete and waiting in Shard::parked
+  bool parked;
+};
+
+time_t monotonic_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+void close_connection(Shard *shard, int fd) {
+  Connection *connection = shard->connections[fd];
+  stringstream payload;
+  payload << " client: " << (void *) connection->client;
   sync_print("close_connection", payload.str());
-  client->close();
-  delete client;
+
+  epoll_ctl(shard->epollFd, EPOLL_CTL_DEL, fd, NULL);
+  delete connection->request;
+  connection->client->close();
+  delete connection->client;
+  delete connection;
+  shard->connections.erase(fd);
+}
+
+bool watch_connection(Shard *shard, int fd) {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.fd = fd;
+  return epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// Take every connection waiting in the listen queue without blocking
+void accept_clients(Shard *shard) {
+  while (true) {
+    int fd = accept4(shard->server->getFd(), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EMFILE || errno == ENFILE) {
+        // they stay queued until a connection closes
+        sync_print("accept_error", "out of file descriptors");
+      }
+      return;
+    }
+    if (!watch_connection(shard, fd)) {
+      close(fd);
+      continue;
+    }
+
+    Connection *connection = new Connection();
+    connection->client = new MySocket(fd);
+    connection->request = new HTTPRequest(connection->client, PORT);
+    connection->served = 0;
+    connection->lastActive = monotonic_seconds();
+    connection->parked = false;
+    shard->connections[fd] = connection;
+    sync_print("client_accepted", "");
+  }
+}
+
+// Move parked requests into the buffer, oldest first, while it has room.
+// Each connection goes back to blocking mode for the worker that writes
+// its response, before a worker can see it: the socket writes treat
+// EAGAIN as a failed client.
+void dispatch_parked(Shard *shard) {
+  while (!shard->parked.empty()) {
+    int fd = shard->parked.front();
+    Connection *connection = shard->connections[fd];
+    HTTPRequest *request = connection->request;
+    bool keepAlive = request->shouldKeepAlive() && connection->served + 1 < MAX_KEEPALIVE_REQUESTS;
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    if (!enqueue_request(shard, connection->client, request, keepAlive)) {
+      // still parked, and still ours
+      fcntl(fd, F_SETFL, flags);
+      return;
+    }
+    shard->parked.pop_front();
+    connection->request = NULL;
+    connection->parked = false;
+    connection->served++;
+  }
+}
+
+// Feed buffered bytes to the connection's parser. Once a request is
+// complete the connection leaves epoll and queues for the buffer behind
+// any parked before it. Bytes past the end of it stay buffered for the
+// next one. Returns false if the connection was closed.
+bool parse_buffered(Shard *shard, int fd) {
+  Connection *connection = shard->connections[fd];
+  stringstream payload;
+  payload << "client: " << (void *) connection->client;
+
+  while (!connection->buffered.empty() && !connection->request->isDone()) {
+    int used = connection->request->addData(connection->buffered.data(), connection->buffered.size());
+    if (used < 0) {
+      sync_print("read_request_error", payload.str());
+      close_connection(shard, fd);
+      return false;
+    }
+    connection->buffered.erase(0, used);
+  }
+  if (!connection->request->isDone()) {
+    return true;
+  }
+
+  sync_print("read_request_return", payload.str());
+  epoll_ctl(shard->epollFd, EPOLL_CTL_DEL, fd, NULL);
+  connection->parked = true;
+  shard->parked.push_back(fd);
+  dispatch_parked(shard);
+  return true;
+}
+
+// One read from a readable connection
+void read_client(Shard *shard, int fd) {
+  Connection *connection = shard->connections[fd];
+  char buffer[READ_CHUNK_SIZE];
+  ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+  if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (length <= 0) {
+    // a client closing between requests is the normal end of keep-alive
+    if (connection->served == 0 || !connection->buffered.empty()) {
+      stringstream payload;
+      payload << "client: " << (void *) connection->client;
+      sync_print("read_request_error", payload.str());
+    }
+    close_connection(shard, fd);
+    return;
+  }
+  connection->lastActive = monotonic_seconds();
+  connection->buffered.append(buffer, length);
+  parse_buffered(shard, fd);
+}
+
+// Collect connections the workers are done with, after giving parked
+// ones the room they made. Kept-alive ones start on their next request,
+// which may already be buffered.
+void resume_returned(Shard *shard) {
+  uint64_t count;
+  if (read(shard->returnedEvent, &count, sizeof(count)) < 0) {
+    return;
+  }
+  dispatch_parked(shard);
+  dthread_mutex_lock(&shard->returnedLock);
+  deque<ReturnedConnection> returned;
+  returned.swap(shard->returnedConnections);
+  dthread_mutex_unlock(&shard->returnedLock);
+
+  for (size_t idx = 0; idx < returned.size(); idx++) {
+    int fd = returned[idx].fd;
+    Connection *connection = shard->connections[fd];
+    if (!returned[idx].keepAlive) {
+      close_connection(shard, fd);
+      continue;
+    }
+    connection->request = new HTTPRequest(connection->client, PORT);
+    connection->lastActive = monotonic_seconds();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (!watch_connection(shard, fd)) {
+      close_connection(shard, fd);
+    } else {
+      parse_buffered(shard, fd);
+    }
+  }
+}
+
+// Close connections that have sat in the loop with nothing new for
+// IDLE_TIMEOUT seconds, whether between requests or partway through one.
+// Parked connections are waiting on us, not the client.
+void close_idle(Shard *shard) {
+  time_t now = monotonic_seconds();
+  vector<int> idle;
+  unordered_map<int, Connection *>::iterator iter;
+  for (iter = shard->connections.begin(); iter != shard->connections.end(); iter++) {
+    if (iter->second->request != NULL && !iter->second->parked && now - iter->second->lastActive >= IDLE_TIMEOUT) {
+      idle.push_back(iter->first);
+    }
+  }
+  for (size_t idx = 0; idx < idle.size(); idx++) {
+    close_connection(shard, idle[idx]);
+  }
+}
+
+// The front end: one thread per shard owns every connection except while
+// a worker is serving one of its requests, so idle and slow clients cost
+// a file descriptor and a parser rather than a worker.
+void *event_loop(void *arg) {
+  Shard *shard = (Shard *) arg;
+  int serverFd = shard->server->getFd();
+  shard->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  shard->returnedEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shard->epollFd < 0 || shard->returnedEvent < 0) {
+    cerr << "Could not create epoll instance" << endl;
+    exit(1);
+  }
+  fcntl(serverFd, F_SETFL, fcntl(serverFd, F_GETFL) | O_NONBLOCK);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = serverFd;
+  epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, serverFd, &event);
+  event.data.fd = shard->returnedEvent;
+  epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->returnedEvent, &event);
+
+  struct epoll_event events[MAX_EVENTS];
+  time_t lastSweep = monotonic_seconds();
+  while (true) {
+    sync_print("waiting_for_events", "");
+    int count = epoll_wait(shard->epollFd, events, MAX_EVENTS, 1000);
+    if (stats_requested && shard->index == 0) {
+      stats_requested = 0;
+      print_cache_stats();
+    }
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cerr << "epoll_wait failed" << endl;
+      exit(1);
+    }
+    for (int idx = 0; idx < count; idx++) {
+      int fd = events[idx].data.fd;
+      if (fd == serverFd) {
+        accept_clients(shard);
+      } else if (fd == shard->returnedEvent) {
+        resume_returned(shard);
+      } else if (shard->connections.count(fd) > 0 && shard->connections[fd]->request != NULL &&
+                 !shard->connections[fd]->parked) {
+        read_client(shard, fd);
+      }
+    }
+    if (monotonic_seconds() != lastSweep) {
+      lastSweep = monotonic_seconds();
+      close_idle(shard);
+    }
+  }
+  return NULL;
+}
+
+// Start a thread for the shard, on its CPU if it has one
+void start_shard_thread(Shard *shard, void *(*function)(void *), bool detach) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (shard->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+  pthread_t thread;
+  if (dthread_create(&thread, &attr, function, shard) != 0) {
+    cerr << "Could not start thread for shard " << shard->index << endl;
+    exit(1);
+  }
+  pthread_attr_destroy(&attr);
+  if (detach) {
+    dthread_detach(thread);
+  }
+}
+
+Shard *create_shard(int index) {
+  Shard *shard = new Shard();
+  shard->index = index;
+  shard->server = new MyServerSocket(PORT, BACKLOG, ACCEPTORS > 1);
+  // pin only when sharding: one shard should run wherever the kernel likes
+  shard->cpu = ACCEPTORS > 1 ? index % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+  shard->requestBuffer = RequestScheduler::create(SCHEDALG);
+  shard->requestSequence = 0;
+  pthread_mutex_init(&shard->bufferLock, NULL);
+  pthread_cond_init(&shard->bufferNotEmpty, NULL);
+  pthread_mutex_init(&shard->returnedLock, NULL);
+  shard->returnedEvent = -1;
+  shard->epollFd = -1;
+  return shard;
 }
 
 int main(int argc, char *argv[]) {
@@ -127,7 +595,7 @@ int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:k:w:a:q:c:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -150,29 +618,80 @@ int main(int argc, char *argv[]) {
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'k':
+      MAX_KEEPALIVE_REQUESTS = atoi(optarg);
+      break;
+    case 'w':
+      IDLE_TIMEOUT = atoi(optarg);
+      break;
+    case 'a':
+      ACCEPTORS = atoi(optarg);
+      break;
+    case 'q':
+      BACKLOG = atoi(optarg);
+      break;
+    case 'c':
+      CACHE_MEGABYTES = atoi(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-s FIFO|SFF|FAIR] [-i diskFile]"
+         << " [-k requestsPerConnection] [-w idleSeconds] [-a acceptors] [-q backlog]"
+         << " [-c cacheMegabytes]" << endl;
       exit(1);
     }
   }
 
+  RequestScheduler *scheduler = RequestScheduler::create(SCHEDALG);
+  if (THREAD_POOL_SIZE < 1 || BUFFER_SIZE < 1 || MAX_KEEPALIVE_REQUESTS < 1 || IDLE_TIMEOUT < 1 ||
+      ACCEPTORS < 1 || BACKLOG < 1 || CACHE_MEGABYTES < 0 || scheduler == NULL) {
+    cerr << "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-s FIFO|SFF|FAIR] [-i diskFile]"
+         << " [-k requestsPerConnection] [-w idleSeconds] [-a acceptors] [-q backlog]"
+         << " [-c cacheMegabytes]" << endl;
+    cerr << "  threads, buffers, requests, idle seconds, acceptors and backlog must be at least 1" << endl;
+    cerr << "  threads and buffers are per acceptor, a cache of 0 turns it off" << endl;
+    exit(1);
+  }
+  delete scheduler;
+
   set_log_file(LOGFILE);
 
   cout << "Lisening on port " << PORT << endl;
   
   sync_print("init", "");
-  MyServerSocket *server = new MyServerSocket(PORT);
-  MySocket *client;
+  signal(SIGUSR1, request_stats);
+
+  // every idle connection holds a descriptor, so allow as many as we may
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
 
   // The order that you push services dictates the search order
   // for path prefix matching
   services.push_back(new DistributedFileSystemService(DISKFILE));
-  services.push_back(new FileService(BASEDIR));
-  
-  while(true) {
-    sync_print("waiting_to_accept", "");
-    client = server->accept();
-    sync_print("client_accepted", "");
-    handle_request(client);
+  file_service = new FileService(BASEDIR, CACHE_MEGABYTES * 1024LL * 1024);
+  services.push_back(file_service);
+
+  vector<Shard *> shards;
+  for (int idx = 0; idx < ACCEPTORS; idx++) {
+    shards.push_back(create_shard(idx));
+  }
+  for (int idx = 0; idx < ACCEPTORS; idx++) {
+    for (int thread = 0; thread < THREAD_POOL_SIZE; thread++) {
+      start_shard_thread(shards[idx], worker, true);
+    }
+    if (idx > 0) {
+      start_shard_thread(shards[idx], event_loop, true);
+    }
+  }
+
+  // the first shard's loop runs here, pinned like the others
+  if (shards[0]->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shards[0]->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
   }
+  event_loop(shards[0]);
 }
@@ -0,0 +1,31 @@
+#ifndef _BLOCK_COMPRESSOR_H_
+#define _BLOCK_COMPRESSOR_H_
+
+/**
+ * A small in-tree codec for the LZ4 block format.
+ *
+ * It trades ratio for speed: one hash probe per position and no match
+ * search beyond it, which is plenty for the text-heavy files we store and
+ * keeps compression cheap next to a disk write.
+ */
+class BlockCompressor {
+ public:
+  /**
+   * Compress `sourceSize` bytes into `dest`.
+   *
+   * Success: number of compressed bytes
+   * Failure: 0 when the output would not fit in `destCapacity`, which
+   * callers treat as "store this data uncompressed".
+   */
+  static int compress(const char *source, int sourceSize, char *dest, int destCapacity);
+
+  /**
+   * Decompress `sourceSize` bytes into `dest`.
+   *
+   * Success: number of decompressed bytes
+   * Failure: -1 for corrupt input or if the output exceeds `destSize`
+   */
+  static int decompress(const char *source, int sourceSize, char *dest, int destSize);
+};
+
+#endif
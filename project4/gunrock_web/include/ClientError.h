@@ -17,6 +17,7 @@ class ClientError : public std::runtime_error {
   static ClientError notFound() { return ClientError("Not Found", 404); }
   static ClientError methodNotAllowed() { return ClientError("Method Not Allowed", 405); }
   static ClientError conflict() { return ClientError("Conflict", 409); }
+  static ClientError rangeNotSatisfiable() { return ClientError("Range Not Satisfiable", 416); }
   static ClientError insufficientStorage() { return ClientError("Insufficient Storage", 507); }
 };
 
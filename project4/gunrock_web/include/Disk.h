@@ -3,29 +3,132 @@
 
 #include <string>
 #include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/types.h>
 
 struct UndoRecord {
   int blockNumber;
   unsigned char *blockData;
 };
 
+// I/O counters since the Disk was opened or resetStats() was last called
+struct DiskStats {
+  long long blockReads;      // blocks read from the image on behalf of callers
+  long long readaheadReads;  // blocks read from the image by the readahead worker
+  long long cacheHits;       // readBlock calls served from the cache
+  long long blockWrites;
+  long long syncs;           // fsync calls
+};
+
+// A block held in the Disk's cache. `ready` is false while a readahead
+// for it is still in flight.
+struct CachedBlock {
+  unsigned char *data;
+  bool ready;
+  std::list<int>::iterator lruPosition;
+};
+
+/**
+ * Block access to a disk image file.
+ *
+ * Every Disk holds a flock on the image for as long as it is open: a
+ * shared one to begin with, upgraded to an exclusive one by the first
+ * write. Any number of Disks can read an image together, but one that
+ * writes has it to itself, so blocks a Disk has cached (and anything its
+ * caller worked out from them) can't be changed underneath it by another
+ * process. Opening an image that another Disk is writing, or writing one
+ * that another Disk has open, prints an error and exits.
+ *
+ * A Disk opened with `locked` false takes no lock at all and can't write.
+ * That is for reading a snapshot while something else writes the live
+ * tree: writers copy a block a snapshot shares before changing it, so a
+ * snapshot's slot and blocks stay as they were until the snapshot is
+ * deleted.
+ */
 class Disk {
  public:
-  Disk(std::string imageFile, int blockSize);
+  Disk(std::string imageFile, int blockSize, bool locked = true);
+  ~Disk();
   void readBlock(int blockNumber, void *buffer);
+  // read `count` consecutive blocks with a single system call
+  void readBlocks(int blockNumber, int count, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
   int numberOfBlocks();
+  // make the image at least `numberOfBlocks` blocks long; new blocks read as zeros
+  void extend(int numberOfBlocks);
+
+  /**
+   * Start reading `blocks` into the cache in the background. Returns
+   * right away; a later readBlock of one of them waits for the read in
+   * flight instead of issuing its own.
+   */
+  void prefetch(const std::vector<int> &blocks);
+  // whether `blockNumber` is in the cache, including reads still in flight
+  bool isCached(int blockNumber);
+
+  // blocks the cache may hold; 0 turns caching and readahead off
+  void setCacheCapacity(int blocks);
+  DiskStats stats();
+  void resetStats();
 
   void beginTransaction();
   void commit();
   void rollback();
+  bool inTransaction() {return isInTransaction;}
+
+  /**
+   * Take the exclusive lock now rather than at the first write, for a
+   * long-running writer that should be refused at startup instead of
+   * failing later. Returns false if another Disk has the image open, or
+   * this one was opened unlocked.
+   */
+  bool lockExclusive();
   
  private:
   std::string imageFile;
   int blockSize;
-  int imageFileSize;
+  // off_t so images larger than 2 GB work
+  off_t imageFileSize;
   bool isInTransaction;
+  // writes made in the transaction that commit still has to fsync
+  bool syncPending;
   std::deque<struct UndoRecord> undoLog;
+
+  // holds the flock, see lockExclusive()
+  int lockFd;
+  bool locked;
+  bool exclusive;
+  // lockExclusive(), or exit
+  void requireExclusive();
+
+  // Write-through cache of recently used blocks, evicted least recently
+  // used first. The flock keeps other processes from writing the image
+  // while it is in use.
+  int cacheCapacity;
+  std::unordered_map<int, CachedBlock> cache;
+  std::list<int> lru;
+  pthread_mutex_t cacheLock;
+  pthread_cond_t blockReady;
+
+  // guarded by cacheLock
+  DiskStats counters;
+
+  // readahead requests, served by one thread started on first use
+  std::deque<int> readaheadQueue;
+  pthread_cond_t readaheadPending;
+  pthread_t readaheadThread;
+  bool readaheadStarted;
+  bool stopping;
+
+  static void *readaheadWorker(void *arg);
+  void readFromImage(int blockNumber, void *buffer);
+  // both expect cacheLock to be held
+  void cacheInsert(int blockNumber, const void *buffer, bool ready);
+  void cacheEvict();
 };
 
 #endif
@@ -5,6 +5,12 @@
 #include "LocalFileSystem.h"
 
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+
+class FileSystemGuard;
 
 class DistributedFileSystemService : public HttpService {
  public:
@@ -13,9 +19,49 @@ class DistributedFileSystemService : public HttpService {
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  virtual void move(HTTPRequest *request, HTTPResponse *response);
+  virtual long long sizeHint(std::string path);
 
 private:
   LocalFileSystem *fileSystem;
+  // held for the whole of each request: LocalFileSystem and Disk keep
+  // per-call state (transactions, readahead windows) that workers can't share
+  pthread_mutex_t fileSystemLock;
+  // Validators, see etag(). Each change to an object gives it the next
+  // number from nextVersion; objects not changed since startup are at 0.
+  unsigned long long bootId;
+  unsigned long long nextVersion;
+  // live inodes by number, -1 for the snapshot list
+  std::unordered_map<int, unsigned long long> versions;
+  // snapshots are read-only, so one number covers everything in one
+  std::unordered_map<std::string, unsigned long long> snapshotVersions;
+  void changed(int inodeNumber);
+
+  // GET response sizes by path, for sizeHint(). They have a lock of their
+  // own so sizeHint never waits on fileSystemLock; anything that changes
+  // the file system clears them.
+  std::unordered_map<std::string, long long> sizeHints;
+  pthread_mutex_t sizeHintLock;
+  void rememberSize(const std::string &path, long long size);
+  void forgetSizes();
+
+  // walk path components starting at `start`, throwing notFound on a miss
+  int resolvePath(LocalFileSystem *fs, std::vector<std::string> &components, size_t start);
+  // file contents, or a directory listing in the format GET returns
+  std::string readEntity(LocalFileSystem *fs, int inodeNumber);
+  // strong validator for an inode in `snapshot` ("" for the live file
+  // system, where -1 is the snapshot list) as of now
+  std::string etag(const std::string &snapshot, int inodeNumber);
+  // answer a GET for a file or directory: a 304 if the client has it,
+  // only the blocks a Range covers, or large files streamed in chunks
+  void sendInode(HTTPRequest *request, HTTPResponse *response, LocalFileSystem *fs, const std::string &snapshot,
+                 int inodeNumber, FileSystemGuard &guard);
+  // send a regular file in chunks, letting go of the lock while each one
+  // is written; gives up if the file's tag stops matching `tag`
+  void streamFile(HTTPResponse *response, LocalFileSystem *fs, const std::string &snapshot, int inodeNumber,
+                  int size, const std::string &tag, FileSystemGuard &guard);
+  // answer a GET with `entity`, or the ranges of it asked for
+  void sendEntity(HTTPRequest *request, HTTPResponse *response, const std::string &entity, const std::string &tag);
 };
 
 #endif
@@ -0,0 +1,79 @@
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Counters since the cache was created
+struct FileCacheStats {
+  // served from memory
+  unsigned long long hits;
+  // not cached, or cached but changed on disk since (also counted in stale)
+  unsigned long long misses;
+  unsigned long long stale;
+  // dropped to stay within the byte budget
+  unsigned long long evictions;
+  unsigned long long entries;
+  long long bytes;
+};
+
+// What the cache keeps for a file, shared with the responses using it
+struct CachedFile {
+  std::string contents;
+  std::string contentType;
+  // Content-Type, Content-Length, Last-Modified, ETag and Accept-Ranges
+  // lines for a plain 200, each ending in CRLF, see
+  // HTTPResponse::setEntityHeaders
+  std::string headers;
+};
+
+/**
+ * Contents of recently served files, least recently used dropped first
+ * once they add up to more than the byte budget. An entry is only used
+ * while the file's inode, size and mtime still match what a fresh stat()
+ * returns, so edits on disk show up on the next request. Safe to use
+ * from several workers at once.
+ */
+class FileCache {
+ public:
+  FileCache(long long capacityBytes);
+  ~FileCache();
+
+  // biggest file worth caching: larger ones would push out many others
+  long long maxEntryBytes() { return capacityBytes / 16; }
+
+  // The cached copy of `path` if it's still current for `st`, NULL
+  // otherwise
+  std::shared_ptr<const CachedFile> lookup(const std::string &path, const struct stat &st);
+  void insert(const std::string &path, const struct stat &st, std::shared_ptr<const CachedFile> file);
+
+  FileCacheStats stats();
+
+ private:
+  struct Entry {
+    std::shared_ptr<const CachedFile> file;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    // position in `recent`
+    std::list<std::string>::iterator position;
+  };
+
+  bool matches(const Entry &entry, const struct stat &st);
+  static long long entryBytes(const CachedFile &file) { return file.contents.size() + file.headers.size(); }
+  void erase(std::unordered_map<std::string, Entry>::iterator iter);
+
+  long long capacityBytes;
+  pthread_mutex_t lock;
+  std::unordered_map<std::string, Entry> entries;
+  // paths, most recently used first
+  std::list<std::string> recent;
+  FileCacheStats counters;
+};
+
+#endif
@@ -1,22 +1,31 @@
 #ifndef _FILESERVICE_H_
 #define _FILESERVICE_H_
 
+#include "FileCache.h"
 #include "HttpService.h"
 
 #include <string>
 
 class FileService : public HttpService {
  public:
-  FileService(std::string basedir);
+  // cacheBytes is the budget for the in-memory file cache, 0 for none
+  FileService(std::string basedir, long long cacheBytes = 0);
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void head(HTTPRequest *request, HTTPResponse *response);
+  virtual long long sizeHint(std::string path);
+  // NULL when caching is off
+  FileCache *getCache() { return m_cache; }
 
 private:
   bool endswith(std::string str, std::string suffix);
-  std::string readFile(std::string path);
+  int openFile(std::string path, struct stat *st);
+  std::string contentType(std::string path);
+  std::string etag(const struct stat &st);
+  std::string entityHeaders(const struct stat &st, const std::string &contentType);
 
   std::string m_basedir;
+  FileCache *m_cache;
 };
 
 #endif
@@ -29,6 +29,10 @@ class HTTP {
     bool isPost() {return m_method == HTTP_POST;}
     bool isDelete() {return m_method == HTTP_DELETE;}
     bool isMove() {return m_method == HTTP_MOVE;}
+    // whether the client wants the connection kept open afterwards
+    bool shouldKeepAlive() {return m_keepAlive;}
+    // whether the client can take a chunked body (HTTP/1.1 or later)
+    bool acceptsChunked() {return m_acceptsChunked;}
     std::string getBody();
     std::string getQuery() {return m_query;}
     std::vector< std::pair< std::string *, std::string *> > getHeaders() {
@@ -61,6 +65,8 @@ class HTTP {
     HttpState m_state;
     bool m_doneParsing;
     bool m_headerDone;
+    bool m_keepAlive;
+    bool m_acceptsChunked;
 
     std::string m_url;
     std::string m_path;
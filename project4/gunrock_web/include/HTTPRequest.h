@@ -19,12 +19,19 @@ public:
   
   bool readRequest();
 
+  // Parses as much of `buffer` as belongs to this request, for callers
+  // that read the socket themselves. Returns how many bytes that was, or
+  // -1 if they aren't a valid request.
+  int addData(const char *buffer, unsigned int len);
+  bool isDone() {return m_http->isDone();}
+
   std::string getHost();
   std::string getRequest();
   std::string getUrl();
   std::string getPath();
   std::vector<std::string> getPathComponents();
   std::string getHeader(std::string key);
+  bool hasHeader(std::string key);
   bool hasAuthToken();
   std::string getAuthToken();
   bool isConnect();
@@ -34,6 +41,8 @@ public:
   bool isPost() {return m_http->isPost();}
   bool isDelete() {return m_http->isDelete();}
   bool isMove() {return m_http->isMove();}
+  bool shouldKeepAlive() {return m_http->shouldKeepAlive();}
+  bool acceptsChunked() {return m_http->acceptsChunked();}
   std::map<std::string, std::string> getParams();
   WwwFormEncodedDict formEncodedBody();
   std::string getBody() {return m_http->getBody();}
@@ -4,12 +4,39 @@
 #include <map>
 #include <string>
 
+#include "MySocket.h"
+
 class HTTPResponse {
  public:
   HTTPResponse();
+  ~HTTPResponse();
+
+  // Chunked responses: after withStreaming() a service can push body
+  // chunks with writeChunk() as it produces them. The first chunk sends
+  // the status line and headers, so those have to be set before it. The
+  // server calls endStream() once the service returns. Only for clients
+  // that accept chunked bodies, see HTTPRequest::acceptsChunked().
   void withStreaming();
+  bool isStreaming() {return streaming;}
+  void setClient(MySocket *client) {this->client = client;}
+  void writeChunk(const void *data, size_t length);
+  void endStream();
+  bool headersSent() {return sentHeaders;}
+
   void setHeader(std::string name, std::string value);
+  // Already serialized header lines describing the body, each ending in
+  // CRLF, such as a cached file's. response() sends them in place of its
+  // own Content-Type and Content-Length; set neither separately.
+  void setEntityHeaders(const std::string &lines);
   void setBody(std::string data);
+  // The body is `length` bytes of the open file `fd` from `offset` on,
+  // and the response now owns fd. response() then returns only the
+  // headers and the caller sends the file itself, see MySocket::sendFile.
+  void setBodyFile(int fd, long long offset, long long length);
+  int getBodyFile() {return bodyFd;}
+  long long getBodyFileOffset() {return bodyFileOffset;}
+  long long getBodyFileLength() {return bodyFileLength;}
+  std::string getContentType() {return contentType;}
   void setContentType(std::string contentType);
   void setStatus(int status);
   int getStatus();
@@ -20,8 +47,14 @@ class HTTPResponse {
 
   int status;
   bool streaming;
+  bool sentHeaders;
+  MySocket *client;
   std::map<std::string, std::string> headers;
+  std::string entityHeaders;
   std::string body;
+  int bodyFd;
+  long long bodyFileOffset;
+  long long bodyFileLength;
   std::string contentType;
 };
 
@@ -1,12 +1,17 @@
 #ifndef HTTP_SERVICE_H_
 #define HTTP_SERVICE_H_
 
+#include <functional>
 #include <string>
 #include <stdexcept>
+#include <vector>
+
+#include <time.h>
 
 #include "MySocket.h"
 #include "HTTPRequest.h"
 #include "HTTPResponse.h"
+#include "HttpUtils.h"
 
 class HttpService {
  public:
@@ -19,7 +24,31 @@ class HttpService {
   virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
   virtual void move(HTTPRequest *request, HTTPResponse *response);
-  
+
+  // Expected size in bytes of a GET response for `path`, or -1 when it
+  // can't be told cheaply. Used to schedule requests, never to answer them.
+  // The event loop calls it, so it must not wait on a service lock.
+  virtual long long sizeHint(std::string path);
+
+ protected:
+  // Sets ETag, and Last-Modified unless lastModified is -1, on a GET or
+  // HEAD response. Returns true, having made the response a 304, when
+  // the request's If-None-Match (or failing that If-Modified-Since) says
+  // the client's copy is current.
+  bool notModified(HTTPRequest *request, HTTPResponse *response, std::string etag, time_t lastModified);
+
+  // The ranges of a `size` byte entity a GET asks for, or none to send
+  // all of it: no Range header, one we ignore, or an If-Range naming
+  // another version than `etag` / `lastModified`. Throws a 416 when no
+  // range overlaps the entity.
+  std::vector<ByteRange> requestedRanges(HTTPRequest *request, HTTPResponse *response, long long size,
+                                         std::string etag, time_t lastModified);
+  // Makes the response a 206 with `ranges` of the entity, using `read`
+  // (offset, length) to fetch each one. More than one range goes out as
+  // multipart/byteranges.
+  void setPartialBody(HTTPResponse *response, const std::vector<ByteRange> &ranges, long long size,
+                      std::function<std::string(long long, long long)> read);
+
  private:
   std::string m_pathPrefix;
 };
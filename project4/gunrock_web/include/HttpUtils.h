@@ -7,6 +7,8 @@
 #include <vector>
 #include <map>
 
+#include <time.h>
+
 #include "MySocket.h"
 
 class MalformedQueryString : public std::runtime_error {
@@ -14,6 +16,12 @@ class MalformedQueryString : public std::runtime_error {
 MalformedQueryString(std::string query) : std::runtime_error("could not parse query string " + query) {}
 };
 
+// Inclusive byte positions, as in "Range: bytes=first-last"
+struct ByteRange {
+  long long first;
+  long long last;
+};
+
 class HttpUtils {
  public:
   static std::map<std::string, std::string> params(std::string query);
@@ -22,6 +30,18 @@ class HttpUtils {
 
   static std::vector<std::string> split(const std::string &s, char delim);
 
+  // "Sun, 06 Nov 1994 08:49:37 GMT", the date format headers use
+  static std::string httpDate(time_t when);
+  // -1 if `date` isn't in that format
+  static time_t parseHttpDate(std::string date);
+  // whether an If-None-Match value ("*" or a list of tags) names `etag`
+  static bool etagMatches(std::string ifNoneMatch, std::string etag);
+  // The ranges a Range header asks for, clipped to an entity of `size`
+  // bytes. Returns 1 with at least one range, 0 if the header should be
+  // ignored (not byte ranges, malformed, too many) and -1 if it is valid
+  // but no range overlaps the entity.
+  static int parseRanges(std::string header, long long size, std::vector<ByteRange> *ranges);
+
  private:
   static std::vector<std::string> &split(const std::string &s,
 					 char delim,
@@ -2,6 +2,8 @@
 #define _LOCAL_FILE_SYSTEM_H_
 
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "Disk.h"
 #include "ufs.h"
@@ -43,6 +45,49 @@
 #define EINVALIDTYPE       (9)
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
+// Modifying a file system opened on a snapshot
+#define EREADONLY          (11)
+
+// Operations for LocalFileSystem::batch
+#define BATCH_LOOKUP  (0)
+#define BATCH_CREATE  (1)
+#define BATCH_WRITE   (2)
+#define BATCH_UNLINK  (3)
+// inodeNumber value meaning "the result of the previous operation", so a
+// create can be followed by a write to the new file
+#define BATCH_PREVIOUS (-1)
+
+/**
+ * One step of a batch. `inodeNumber` is the parent directory for lookup,
+ * create and unlink and the file itself for write; fields an operation
+ * doesn't use are ignored. `result` is filled in with what the matching
+ * single call returns.
+ */
+struct BatchOp {
+  int op;
+  int inodeNumber;
+  int type;
+  std::string name;
+  const void *buffer;
+  int size;
+  int result;
+};
+
+// A metadata region held in memory while a batch runs
+struct BatchRegion {
+  unsigned char *data;
+  int addr;
+  int len;
+  bool dirty;
+};
+
+// Readahead state for one inode: the window, in blocks, and where the
+// last read stopped so the next one can tell it carries on from there
+struct ReadaheadState {
+  int window;
+  int nextOffset;
+  int issuedUpTo;
+};
 
 class LocalFileSystem {
  public:
@@ -113,6 +158,22 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * Read part of a file or directory.
+   *
+   * Like read(), but starts `offset` bytes in and only reads the direct[]
+   * blocks that cover the bytes asked for. A read that starts where the
+   * last one of this inode ended also prefetches past its own range, so
+   * a file read in chunks keeps its readahead going. Reads to the end of
+   * the file when size <= 0 or the file ends first. Compressed files only
+   * decode the frames holding those bytes.
+   *
+   * Success: number of bytes read, 0 when offset is at or past the end
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, negative offset.
+   */
+  int readAt(int inodeNumber, void *buffer, int offset, int size);
+
   /**
    * Remove a file or directory.
    *
@@ -126,6 +187,145 @@ class LocalFileSystem {
    * existing is NOT a failure by our definition. You can't unlink '.' or '..'
    */
   int unlink(int parentInodeNumber, std::string name);
+
+  /**
+   * Move or rename a file or directory.
+   *
+   * Moves the entry srcName in srcParentInodeNumber to dstName in
+   * dstParentInodeNumber. Only directory entries change (plus '..' when a
+   * directory changes parent); file data is never copied. An existing
+   * dstName of the same type is replaced, as long as it is not a
+   * non-empty directory. The move is atomic: outside a transaction it
+   * runs in one of its own, so a failure after the replaced entry is
+   * unlinked leaves it in place.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDTYPE, -EINVALIDNAME, -ENOTFOUND,
+   * -EDIRNOTEMPTY, -EUNLINKNOTALLOWED, -ENOTENOUGHSPACE, -EREADONLY
+   * Failure modes: a parent does not exist or isn't a directory, a name is
+   * invalid, srcName does not exist, dstName exists with a different type
+   * or is a non-empty directory, moving '.' or '..', moving a directory
+   * into itself or one of its descendants (-EINVALIDNAME), the destination
+   * directory is full, or this object is a snapshot view.
+   */
+  int rename(int srcParentInodeNumber, std::string srcName,
+             int dstParentInodeNumber, std::string dstName);
+
+  /**
+   * Run lookups, creates, writes and unlinks as one atomic unit.
+   *
+   * The bitmaps, inode table and extension regions are loaded once,
+   * updated in memory by every operation, and written back once at the
+   * end, all inside a single Disk transaction. Operations run in order
+   * and the batch stops at the first one that fails, undoing everything
+   * before it. The caller must not already be in a transaction.
+   *
+   * Success: number of operations run
+   * Failure: the first failing operation's error, or -EREADONLY
+   */
+  int batch(std::vector<BatchOp> &ops);
+
+  /**
+   * Write a file in pieces without holding all of it in memory.
+   *
+   * beginWrite truncates the file and opens a stream on it, appendChunk
+   * adds bytes to the end, and endWrite closes the stream. Like batch(),
+   * the stream runs in one Disk transaction with the metadata regions
+   * held in memory, so a chunk only costs its own data blocks. endWrite
+   * with `commit` false, or after a failed chunk, undoes the whole stream
+   * and leaves the old contents. One stream at a time, and the caller
+   * must not already be in a transaction.
+   *
+   * Success: beginWrite 0, appendChunk bytes appended (short when the
+   *          file or the disk is full), endWrite the new file size, or 0
+   *          when it was asked to roll back
+   * Failure: as write(), and -EINVALIDINODE for appendChunk or endWrite
+   *          without an open stream
+   */
+  int beginWrite(int inodeNumber);
+  int appendChunk(const void *buffer, int size);
+  int endWrite(bool commit);
+
+  /**
+   * Turn compression on or off for a regular file.
+   *
+   * Requires an image with UFS_FEATURE_COMPRESSION. The current contents
+   * are stored again in the new representation, so wrap the call in a
+   * transaction if running out of space midway must not lose data.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDTYPE, -ENOTENOUGHSPACE
+   * Failure modes: invalid inodeNumber, not a regular file, the image has
+   * no compression support, or the re-encoded contents did not fit.
+   */
+  int setCompressed(int inodeNumber, bool compressed);
+
+  /**
+   * Number of direct[] blocks holding an inode's data. This is
+   * size / UFS_BLOCK_SIZE rounded up, except for compressed files.
+   *
+   * Success: number of blocks
+   * Failure: -EINVALIDINODE
+   */
+  int blockCount(int inodeNumber);
+
+  /**
+   * Take a snapshot of the whole file system.
+   *
+   * Requires an image with UFS_FEATURE_SNAPSHOT. Only metadata is copied;
+   * data blocks are shared with the live file system and copied on write.
+   *
+   * Success: 0
+   * Failure: -EINVALIDTYPE, -EINVALIDNAME, -ENOTENOUGHSPACE, -EREADONLY
+   * Failure modes: the image has no snapshot support, the name is empty,
+   * too long or already taken, every snapshot slot is in use, or this
+   * object is a snapshot view.
+   */
+  int createSnapshot(std::string name);
+
+  /**
+   * Delete a snapshot, freeing the blocks only it still references.
+   *
+   * Success: 0
+   * Failure: -ENOTFOUND, -EREADONLY
+   */
+  int deleteSnapshot(std::string name);
+
+  /**
+   * Fill `snapshots` with the existing snapshots, oldest slot first.
+   *
+   * Success: number of snapshots
+   * Failure: -EINVALIDTYPE if the image has no snapshot support
+   */
+  int listSnapshots(std::vector<snapshot_t> *snapshots);
+
+  /**
+   * Switch this object to a read-only view of a snapshot. Lookups, stats
+   * and reads then see the file system as it was when the snapshot was
+   * taken, and calls that modify it return -EREADONLY.
+   *
+   * Success: 0
+   * Failure: -ENOTFOUND
+   */
+  int openSnapshot(std::string name);
+
+  /**
+   * Grow the file system in place to `numInodes` inodes and `numData`
+   * data blocks.
+   *
+   * The data region keeps its address, so block pointers stay valid: it
+   * is extended at its end and the bitmaps, the inode table and any
+   * extension regions (snapshot slots included) are moved after it. The
+   * image file grows as needed. The new regions can overlap the old ones,
+   * so wrap the call in a transaction.
+   *
+   * Success: 0
+   * Failure: -EINVALIDSIZE, -ENOTENOUGHSPACE, -EREADONLY
+   * Failure modes: a count is smaller than it is now, the new layout has
+   * block numbers that do not fit in an int, or this object is a snapshot
+   * view.
+   */
+  int grow(int numInodes, int numData);
   
   /**
    * Some helper functions that you need to implement and use in your
@@ -143,10 +343,99 @@ class LocalFileSystem {
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
 
+  // Extension helpers. readSuperExtension zeroes `ext` on classic images,
+  // so `ext->features` is always safe to test.
+  void readSuperExtension(super_ext_t *ext);
+  void readRefcountRegion(super_ext_t *ext, unsigned int *refcounts);
+  void writeRefcountRegion(super_ext_t *ext, unsigned int *refcounts);
+  void readFingerprintRegion(super_ext_t *ext, unsigned long long *fingerprints);
+  void writeFingerprintRegion(super_ext_t *ext, unsigned long long *fingerprints);
+  void readInodeExtRegion(super_ext_t *ext, inode_ext_t *inodeExts);
+  void writeInodeExtRegion(super_ext_t *ext, inode_ext_t *inodeExts);
+
   // Normally we'd mark this as private but we expose it so that you can access
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
-};  
+
+ private:
+  // first block of the snapshot slot this object views, or -1 for the
+  // live file system
+  int snapshotBase;
+
+  // Set while batch() runs: the region helpers then read and write
+  // batchRegions instead of the disk.
+  enum { REGION_INODE_BITMAP, REGION_DATA_BITMAP, REGION_INODES,
+         REGION_REFCOUNTS, REGION_FINGERPRINTS, REGION_INODE_EXTS, REGION_COUNT };
+  bool batching;
+  BatchRegion batchRegions[REGION_COUNT];
+
+  void readRegion(int region, int addr, int len, void *buffer);
+  void writeRegion(int region, int addr, int len, const void *buffer);
+  void beginBatch();
+  // writes dirty regions back when `flush` is set, then drops them
+  void endBatch(bool flush);
+
+  // inode of the stream opened by beginWrite, or -1, and the error of
+  // the first chunk that failed, which makes endWrite roll back
+  int streamInode;
+  int streamError;
+
+  // rename() without its transaction
+  int renameEntry(int srcParentInodeNumber, std::string srcName,
+                  int dstParentInodeNumber, std::string dstName);
+
+  // slot index of the snapshot called `name`, or -ENOTFOUND
+  int findSnapshot(super_ext_t *ext, std::string name);
+
+  /**
+   * Make sure a directory block can be written without changing what a
+   * snapshot sees, copying it to a new block if it is shared. Returns the
+   * absolute block number to write to, or -ENOTENOUGHSPACE.
+   */
+  int unshareBlock(super_t *super, int absoluteBlockNumber, unsigned char *dataBitMap,
+                   unsigned int *refcounts);
+
+  // write() and appendChunk(): replace the file's contents, or add to them
+  int storeFile(int inodeNumber, const char *buffer, int size, bool append);
+
+  /**
+   * Store `size` bytes in the inode's direct[] blocks from `firstBlock`
+   * on, reusing the `oldBlockCount` blocks it already has and freeing any
+   * left over. With refcounts (UFS_FEATURE_DEDUP) each block is hashed
+   * and, when a live block with identical contents exists, shared instead
+   * of allocated. Returns the number of bytes stored.
+   */
+  int placeBlocks(super_t *super, inode_t *inode, int oldBlockCount, int firstBlock,
+                  const char *data, int size, unsigned char *dataBitMap,
+                  unsigned int *refcounts, unsigned long long *fingerprints);
+
+  /**
+   * Fingerprint to relative block number for the data blocks dedup can
+   * share, loaded from the fingerprint region on first use and kept up to
+   * date by placeBlocks. It is only a hint: freed blocks and rolled back
+   * writes leave stale entries behind, so a candidate is checked against
+   * the region (then byte for byte) before it is shared, and dropped if
+   * it no longer matches.
+   */
+  std::unordered_multimap<unsigned long long, int> fingerprintIndex;
+  bool fingerprintIndexLoaded;
+  void loadFingerprintIndex(super_t *super, unsigned int *refcounts, unsigned long long *fingerprints);
+
+  // readAt() for files flagged UFS_INODE_COMPRESSED: decodes only the
+  // frames covering the bytes asked for
+  int readCompressed(inode_t *inode, void *buffer, int offset, int size);
+
+  // Readahead state for each inode read so far. The window grows while
+  // prefetched blocks arrive in time and shrinks when they don't.
+  std::unordered_map<int, ReadaheadState> readaheads;
+
+  /**
+   * Keep `window` blocks in flight ahead of `blockIndex` for a read
+   * walking the first `blocks` direct[] entries. `*issuedUpTo` is the
+   * end of what has been requested so far.
+   */
+  void readAhead(inode_t *inode, int blockIndex, int blocks, int window, int *issuedUpTo);
+};
 
 #endif
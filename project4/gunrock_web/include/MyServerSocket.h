@@ -4,6 +4,8 @@
 #include <stdexcept>
 #include <string>
 
+#include <sys/socket.h>
+
 #include "MySocket.h"
 
 class MyServerSocket {
@@ -13,8 +15,11 @@ class MyServerSocket {
    * if it cannot bind, it will throw a socket exception.
    *
    * @param port the port to bind to
+   * @param backlog how many connections may wait to be accepted
+   * @param reusePort set SO_REUSEPORT, so several sockets can share the
+   *        port and the kernel balances new connections across them
    */
-  MyServerSocket(int port);
+  MyServerSocket(int port, int backlog = SOMAXCONN, bool reusePort = false);
   MyServerSocket() { serverFd = -1; }
   
   /**
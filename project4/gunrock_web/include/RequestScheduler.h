@@ -0,0 +1,103 @@
+#ifndef _REQUESTSCHEDULER_H_
+#define _REQUESTSCHEDULER_H_
+
+#include <deque>
+#include <list>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "HTTPRequest.h"
+#include "MySocket.h"
+
+// A fully read request waiting in the request buffer
+struct QueuedRequest {
+  MySocket *client;
+  HTTPRequest *request;
+  // leave the connection open for another request after this one
+  bool keepAlive;
+  // bytes the response is expected to carry, for smallest-file-first
+  long long cost;
+  // when it was queued, in milliseconds on the monotonic clock
+  long long arrivalMs;
+  // who sent it (the peer address), for fair queueing
+  std::string clientKey;
+  // arrival order, breaks ties
+  unsigned long long sequence;
+};
+
+/**
+ * Decides which buffered request a worker serves next. The server
+ * picks one at startup with -s. Schedulers do no locking of their own;
+ * callers hold the buffer lock around every call.
+ */
+class RequestScheduler {
+ public:
+  virtual ~RequestScheduler() {}
+
+  // what put() needs filled in besides `client`, `request`, `keepAlive`,
+  // `arrivalMs` and `sequence`
+  virtual bool needsCost() { return false; }
+  virtual bool needsClientKey() { return false; }
+
+  virtual void put(const QueuedRequest &request) = 0;
+  // only called when size() > 0
+  virtual QueuedRequest take() = 0;
+  virtual size_t size() = 0;
+
+  // FIFO, SFF or FAIR; NULL for anything else
+  static RequestScheduler *create(std::string name);
+};
+
+// Requests in the order they finished arriving
+class FifoScheduler : public RequestScheduler {
+ public:
+  virtual void put(const QueuedRequest &request);
+  virtual QueuedRequest take();
+  virtual size_t size();
+
+ private:
+  std::deque<QueuedRequest> queue;
+};
+
+// How much a request's cost drops per millisecond it waits under SFF.
+// Newer requests can only overtake one of cost C for about
+// C / SFF_AGING_BYTES_PER_MS milliseconds (1 MB: about a second), so a
+// steady stream of small requests can't starve a large one.
+#define SFF_AGING_BYTES_PER_MS (1024)
+
+// Smallest expected response first, aged by waiting time (see above),
+// oldest first among equals
+class SmallestFileFirstScheduler : public RequestScheduler {
+ public:
+  virtual bool needsCost() { return true; }
+  virtual void put(const QueuedRequest &request);
+  virtual QueuedRequest take();
+  virtual size_t size();
+
+ private:
+  struct LargerCost {
+    bool operator()(const QueuedRequest &a, const QueuedRequest &b) const;
+  };
+  std::priority_queue<QueuedRequest, std::vector<QueuedRequest>, LargerCost> queue;
+};
+
+// One FIFO per client, served round robin, so a client that opens many
+// connections can't crowd out the others
+class FairScheduler : public RequestScheduler {
+ public:
+  FairScheduler() : count(0) {}
+  virtual bool needsClientKey() { return true; }
+  virtual void put(const QueuedRequest &request);
+  virtual QueuedRequest take();
+  virtual size_t size();
+
+ private:
+  std::map<std::string, std::deque<QueuedRequest> > queues;
+  // clients with something queued, next to be served first
+  std::list<std::string> turns;
+  size_t count;
+};
+
+#endif
@@ -40,5 +40,63 @@ typedef struct __super {
     int num_data;          // and data blocks...
 } super_t;
 
+// Optional on-disk extensions.
+//
+// The classic layout above never changes. An image formatted with
+// extensions stores a super_ext_t in block 0 right after super_t and puts
+// the extension regions between the inode region and the data region.
+// Classic images have zeros there, which reads as "no features".
+#define UFS_EXT_MAGIC (0x45335344) // "DS3E"
+
+#define UFS_FEATURE_DEDUP       (0x1) // share identical data blocks
+#define UFS_FEATURE_COMPRESSION (0x2) // per-file block compression
+#define UFS_FEATURE_SNAPSHOT    (0x4) // read-only point-in-time views
+
+typedef struct {
+    int magic;            // UFS_EXT_MAGIC when the extension is present
+    int features;         // UFS_FEATURE_* bits
+    int refcount_addr;    // block address (in blocks)
+    int refcount_len;     // in blocks, one unsigned int per data block
+    int fingerprint_addr; // block address (in blocks)
+    int fingerprint_len;  // in blocks, one 64-bit content hash per data block
+    int inode_ext_addr;   // block address (in blocks)
+    int inode_ext_len;    // in blocks, one inode_ext_t per inode
+    int snapshot_addr;    // block address (in blocks)
+    int snapshot_slots;   // number of snapshots the image can hold
+    int snapshot_len;     // in blocks, per slot
+} super_ext_t;
+
+#define UFS_SUPER_EXT_OFFSET (sizeof(super_t))
+
+// Per-inode state that does not fit in inode_t.
+#define UFS_INODE_COMPRESSED (0x1)
+
+typedef struct {
+    int flags;       // UFS_INODE_* bits
+    int stored_size; // bytes held in direct[] blocks, when it differs from size
+} inode_ext_t;
+
+// A compressed file's direct[] blocks hold a single stream: this header
+// followed by one frame per 4 KiB of file data. Each frame is a codec byte
+// and its payload, and frames are compressed independently, so reading
+// part of a file only touches the blocks holding the frames it needs.
+#define UFS_FRAME_RAW (0)
+#define UFS_FRAME_LZ4 (1)
+
+typedef struct {
+    int frame_count;
+    int frame_end[DIRECT_PTRS]; // stream offset just past each frame
+} compressed_header_t;
+
+// A snapshot slot is a snapshot_t header block followed by copies of the
+// inode bitmap, data bitmap, inode region and inode ext region taken when
+// the snapshot was created. The snapshot holds one reference (see the
+// refcount region) on every data block allocated at that time, and live
+// writes copy a block before changing it while it is shared.
+typedef struct {
+    int in_use;                   // 1 when the slot holds a snapshot
+    int created;                  // seconds since the epoch
+    char name[DIR_ENT_NAME_SIZE]; // including \0
+} snapshot_t;
 
 #endif // __ufs_h__
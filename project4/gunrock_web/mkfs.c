@@ -1,31 +1,102 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-D] [-C] [-S <num_snapshots>]\n");
+    fprintf(stderr, "  -D  enable block deduplication (adds refcount and fingerprint regions)\n");
+    fprintf(stderr, "  -C  enable per-file compression (adds the inode ext region)\n");
+    fprintf(stderr, "  -S  reserve room for snapshots (adds refcount and snapshot regions)\n");
     exit(1);
 }
 
+// Parse a count, rejecting junk and anything below `minimum`.
+long long parse_count(const char *arg, long long minimum) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || value < minimum)
+	usage();
+    return value;
+}
+
+// Blocks needed for `bytes`, failing if a block address could not hold it.
+int blocks_for(long long bytes) {
+    long long blocks = (bytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    if (blocks > INT_MAX) {
+	fprintf(stderr, "mkfs: image too large, block addresses must fit in an int\n");
+	exit(1);
+    }
+    return (int) blocks;
+}
+
+// Only a handful of blocks in a fresh image are non-zero. They are
+// collected here and written with as few pwritev calls as possible.
+#define MAX_PENDING (8)
+typedef struct {
+    int addr;
+    void *data;
+} pending_block_t;
+
+pending_block_t pending[MAX_PENDING];
+int num_pending = 0;
+
+void queue_block(int addr, void *data) {
+    assert(num_pending < MAX_PENDING);
+    pending[num_pending].addr = addr;
+    pending[num_pending].data = data;
+    num_pending++;
+}
+
+int compare_pending(const void *a, const void *b) {
+    return ((const pending_block_t *) a)->addr - ((const pending_block_t *) b)->addr;
+}
+
+void flush_blocks(int fd) {
+    qsort(pending, num_pending, sizeof(pending_block_t), compare_pending);
+    int i = 0;
+    while (i < num_pending) {
+	// one pwritev per run of adjacent blocks
+	struct iovec iov[MAX_PENDING];
+	int run = 0;
+	while (i + run < num_pending && pending[i + run].addr == pending[i].addr + run) {
+	    iov[run].iov_base = pending[i + run].data;
+	    iov[run].iov_len = UFS_BLOCK_SIZE;
+	    run++;
+	}
+	ssize_t rc = pwritev(fd, iov, run, (off_t) pending[i].addr * UFS_BLOCK_SIZE);
+	if (rc != (ssize_t) run * UFS_BLOCK_SIZE) {
+	    perror("write");
+	    exit(1);
+	}
+	i += run;
+    }
+}
+
 int main(int argc, char *argv[]) {
     int ch;
     char *image_file = NULL;
-    int num_inodes = 32;
-    int num_data = 32;
+    long long num_inodes = 32;
+    long long num_data = 32;
     int visual = 0;
+    int features = 0;
+    int num_snapshots = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:vDCS:")) != -1) {
 	switch (ch) {
 	case 'i':
-	    num_inodes = atoi(optarg);
+	    num_inodes = parse_count(optarg, 32);
 	    break;
 	case 'd':
-	    num_data = atoi(optarg);
+	    num_data = parse_count(optarg, 32);
 	    break;
 	case 'f':
 	    image_file = optarg;
@@ -33,6 +104,16 @@ int main(int argc, char *argv[]) {
 	case 'v':
 	    visual = 1;
 	    break;
+	case 'D':
+	    features |= UFS_FEATURE_DEDUP;
+	    break;
+	case 'C':
+	    features |= UFS_FEATURE_COMPRESSION;
+	    break;
+	case 'S':
+	    features |= UFS_FEATURE_SNAPSHOT;
+	    num_snapshots = (int) parse_count(optarg, 1);
+	    break;
 	default:
 	    usage();
 	}
@@ -42,22 +123,9 @@ int main(int argc, char *argv[]) {
 
     if (image_file == NULL)
 	usage();
-
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
-    }
-
-    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-	perror("open");
-	exit(1);
-    }
-
-    assert(num_inodes >= 32);
-    assert(num_data >= 32);
+    // counts are stored as ints on disk
+    if (num_inodes > INT_MAX || num_data > INT_MAX || num_snapshots > INT_MAX)
+	usage();
 
     // presumed: block 0 is the super block
     super_t s;
@@ -67,56 +135,99 @@ int main(int argc, char *argv[]) {
     s.num_data = num_data;
 
     // inode bitmap
-    int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
-
     s.inode_bitmap_addr = 1;
-    s.inode_bitmap_len = num_inodes / bits_per_block;
-    if (num_inodes % bits_per_block != 0)
-	s.inode_bitmap_len++;
+    s.inode_bitmap_len = blocks_for((num_inodes + 7) / 8);
 
     // data bitmap
     s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
-    s.data_bitmap_len = num_data / bits_per_block;
-    if (num_data % bits_per_block != 0)
-	s.data_bitmap_len++;
+    s.data_bitmap_len = blocks_for((num_data + 7) / 8);
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
-    s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-    if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
-	s.inode_region_len++;
+    s.inode_region_len = blocks_for(num_inodes * (long long) sizeof(inode_t));
+
+    // optional extension regions sit between the inode table and the data
+    super_ext_t ext;
+    memset(&ext, 0, sizeof(ext));
+    long long next_addr = (long long) s.inode_region_addr + s.inode_region_len;
+    if (features != 0) {
+	ext.magic = UFS_EXT_MAGIC;
+	ext.features = features;
+    }
+    // shared blocks, whether by dedup or by a snapshot, need a refcount
+    if (features & (UFS_FEATURE_DEDUP | UFS_FEATURE_SNAPSHOT)) {
+	ext.refcount_addr = blocks_for(next_addr * UFS_BLOCK_SIZE);
+	ext.refcount_len = blocks_for(num_data * (long long) sizeof(unsigned int));
+	next_addr += ext.refcount_len;
+    }
+    if (features & UFS_FEATURE_DEDUP) {
+	ext.fingerprint_addr = blocks_for(next_addr * UFS_BLOCK_SIZE);
+	ext.fingerprint_len = blocks_for(num_data * (long long) sizeof(unsigned long long));
+	next_addr += ext.fingerprint_len;
+    }
+    if (features & UFS_FEATURE_COMPRESSION) {
+	ext.inode_ext_addr = blocks_for(next_addr * UFS_BLOCK_SIZE);
+	ext.inode_ext_len = blocks_for(num_inodes * (long long) sizeof(inode_ext_t));
+	next_addr += ext.inode_ext_len;
+    }
+    if (features & UFS_FEATURE_SNAPSHOT) {
+	// header block, then copies of both bitmaps and the inode tables
+	long long slot_len = 1LL + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + ext.inode_ext_len;
+	ext.snapshot_addr = blocks_for(next_addr * UFS_BLOCK_SIZE);
+	ext.snapshot_slots = num_snapshots;
+	ext.snapshot_len = blocks_for(slot_len * UFS_BLOCK_SIZE);
+	next_addr += (long long) ext.snapshot_slots * ext.snapshot_len;
+    }
 
     // data blocks
-    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
+    s.data_region_addr = blocks_for(next_addr * UFS_BLOCK_SIZE);
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
-
-    // super block is the first block
-    int rc = pwrite(fd, &s, sizeof(super_t), 0);
-    if (rc != sizeof(super_t)) {
-	perror("write");
-	exit(1);
-    }
+    // every block number, including the last, has to fit in an int
+    int total_blocks = blocks_for((next_addr + s.data_region_len) * UFS_BLOCK_SIZE);
 
     printf("total blocks        %d\n", total_blocks);
-    printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
-    printf("  data blocks       %d\n", num_data);
+    printf("  inodes            %lld [size of each: %lu]\n", num_inodes, sizeof(inode_t));
+    printf("  data blocks       %lld\n", num_data);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    if (ext.refcount_len > 0) {
+	printf("  refcount address/len     %d [%d]\n", ext.refcount_addr, ext.refcount_len);
+    }
+    if (features & UFS_FEATURE_DEDUP) {
+	printf("  fingerprint address/len  %d [%d]\n", ext.fingerprint_addr, ext.fingerprint_len);
+    }
+    if (features & UFS_FEATURE_COMPRESSION) {
+	printf("  inode ext address/len    %d [%d]\n", ext.inode_ext_addr, ext.inode_ext_len);
+    }
+    if (features & UFS_FEATURE_SNAPSHOT) {
+	printf("  snapshot address/len     %d [%d x %d]\n", ext.snapshot_addr, ext.snapshot_slots, ext.snapshot_len);
+    }
 
-    // first, zero out all the blocks
-    int i;
-    for (i = 1; i < total_blocks; i++) {
-        rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-        if (rc != UFS_BLOCK_SIZE) {
-            perror("write");
-            exit(1);
-        }
+    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+	perror("open");
+	exit(1);
+    }
+
+    // size the image in one go: the file stays sparse, so untouched
+    // metadata and data blocks read back as zeros without being written
+    if (ftruncate(fd, (off_t) total_blocks * UFS_BLOCK_SIZE) != 0) {
+	perror("ftruncate");
+	exit(1);
     }
-    free(empty_buffer);
+
+    //
+    // super block is the first block; classic images leave the
+    // extension bytes zero
+    //
+    unsigned char super_block[UFS_BLOCK_SIZE];
+    memset(super_block, 0, sizeof(super_block));
+    memcpy(super_block, &s, sizeof(super_t));
+    memcpy(super_block + UFS_SUPER_EXT_OFFSET, &ext, sizeof(super_ext_t));
+    queue_block(0, super_block);
+    int i;
 
     //
     // need to allocate first inode in inode bitmap
@@ -130,16 +241,23 @@ int main(int argc, char *argv[]) {
     for (i = 0; i < 4096; i++)
 	b.bits[i] = 0;
     b.bits[0] = 0x1; // first entry is allocated
-    
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    queue_block(s.inode_bitmap_addr, &b);
 
     //
     // need to allocate first data block in data bitmap
     // (can just reuse this to write out data bitmap too)
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    queue_block(s.data_bitmap_addr, &b);
+
+    //
+    // the root directory block has one owner
+    //
+    unsigned int refcounts[UFS_BLOCK_SIZE / sizeof(unsigned int)];
+    if (ext.refcount_len > 0) {
+	memset(refcounts, 0, sizeof(refcounts));
+	refcounts[0] = 1;
+	queue_block(ext.refcount_addr, refcounts);
+    }
 
     //
     // need to write out inode
@@ -149,14 +267,14 @@ int main(int argc, char *argv[]) {
     } inode_block;
 
     inode_block itable;
+    memset(&itable, 0, sizeof(itable));
     itable.inodes[0].type = UFS_DIRECTORY;
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
     itable.inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
 	itable.inodes[0].direct[i] = -1;
 
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    queue_block(s.inode_region_addr, &itable);
 
     // 
     // need to write out root directory contents to first data block
@@ -169,6 +287,7 @@ int main(int argc, char *argv[]) {
     assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
 
     dir_block_t parent;
+    memset(&parent, 0, sizeof(parent));
     strcpy(parent.entries[0].name, ".");
     parent.entries[0].inum = 0;
 
@@ -178,8 +297,11 @@ int main(int argc, char *argv[]) {
     for (i = 2; i < 128; i++)
 	parent.entries[i].inum = -1;
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    queue_block(s.data_region_addr, &parent);
+
+    // super, bitmaps and inode table are adjacent, so this is usually
+    // just a couple of writes no matter how big the image is
+    flush_blocks(fd);
 
     if (visual) {
 	int i;
@@ -191,6 +313,14 @@ int main(int argc, char *argv[]) {
 	    printf("d");
 	for (i = 0; i < s.inode_region_len; i++)
 	    printf("I");
+	for (i = 0; i < ext.refcount_len; i++)
+	    printf("R");
+	for (i = 0; i < ext.fingerprint_len; i++)
+	    printf("F");
+	for (i = 0; i < ext.inode_ext_len; i++)
+	    printf("E");
+	for (i = 0; i < ext.snapshot_slots * ext.snapshot_len; i++)
+	    printf("S");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
 	printf("\n\n");
@@ -1,11 +1,13 @@
 #include "MySocket.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <string>
+#include <vector>
 
 #include <iostream>
 
@@ -80,6 +82,45 @@ void MySocket::write_bytes(const void *buffer, int len) {
     }
 }
 
+void MySocket::sendFile(int fd, off_t offset, size_t count) {
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    while(count > 0) {
+        ssize_t bytesSent = ::sendfile(sockFd, fd, &offset, count);
+        if(bytesSent <= 0) {
+	  // an error, or the file is shorter than we promised the client
+	  throw SocketWriteError();
+        }
+        count -= bytesSent;
+    }
+}
+
+void MySocket::writev(const struct iovec *iov, int count) {
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    // a short write leaves us partway through some buffer
+    vector<struct iovec> pending(iov, iov + count);
+    size_t next = 0;
+    while(next < pending.size()) {
+        ssize_t bytesWritten = ::writev(sockFd, &pending[next], pending.size() - next);
+        if(bytesWritten <= 0) {
+	  throw SocketWriteError();
+        }
+        while(next < pending.size() && (size_t) bytesWritten >= pending[next].iov_len) {
+            bytesWritten -= pending[next].iov_len;
+            next++;
+        }
+        if(next < pending.size()) {
+            pending[next].iov_base = (char *) pending[next].iov_base + bytesWritten;
+            pending[next].iov_len -= bytesWritten;
+        }
+    }
+}
+
 string MySocket::read() {
     char buffer[4096];
     if(sockFd<0) {
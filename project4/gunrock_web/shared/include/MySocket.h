@@ -4,6 +4,9 @@
 #include <stdexcept>
 #include <string>
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 class SocketNotConnected : public std::runtime_error {
  public:
   SocketNotConnected() : std::runtime_error("socket not connected") {}
@@ -51,7 +54,19 @@ class MySocket {
 
   virtual std::string read();
   virtual void write(std::string data);
+  /*
+   * sends `count` bytes of the open file `fd` starting at `offset`,
+   * copied by the kernel straight from the page cache to the socket
+   */
+  virtual void sendFile(int fd, off_t offset, size_t count);
+  /*
+   * writes the buffers one after another with as few system calls as
+   * the socket allows, without first copying them together
+   */
+  virtual void writev(const struct iovec *iov, int count);
   virtual void close(void);
+
+  int getFd() { return sockFd; }
   
  protected:
   void call_connect(const char *inetAddr, int port);